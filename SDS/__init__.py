@@ -0,0 +1,32 @@
+"""SDS -- Serverless Data Shield.
+
+Submodules load on first attribute access, so ``import SDS`` costs next to
+nothing on a cold start::
+
+    import SDS
+
+    with SDS.secureContext.SecureContext(envelopes) as ctx:
+        ...
+"""
+
+import importlib
+
+__all__ = [
+    "backends",
+    "cleanUp",
+    "cryptoHandler",
+    "lambdaExtension",
+    "metrics",
+    "secureBuffer",
+    "secureContext",
+]
+
+
+def __getattr__(name):
+    if name in __all__:
+        return importlib.import_module(f".{name}", __name__)
+    raise AttributeError(f"module {__name__!r} has no attribute {name!r}")
+
+
+def __dir__():
+    return sorted(set(globals()) | set(__all__))
@@ -0,0 +1,572 @@
+"""AEAD backends for :mod:`SDS.cryptoHandler`, chosen at runtime.
+
+``openssl``
+    libcrypto's EVP interface through ``ctypes``.  OpenSSL dispatches on the
+    CPU itself (AES-NI/VAES/PCLMULQDQ on x86-64, the ARMv8 crypto
+    extensions on Graviton), and plaintext is decrypted straight into the
+    caller's buffer.
+``cryptography``
+    The ``cryptography`` package, when it is installed.
+``python``
+    A pure-Python ChaCha20-Poly1305 (RFC 8439) that works everywhere but is
+    two orders of magnitude slower.
+
+The first backend that loads is used unless ``SDS_CRYPTO_BACKEND`` or
+:func:`set_backend` says otherwise; :func:`describe` reports the choice.
+New envelopes use AES-256-GCM when the CPU accelerates it and
+ChaCha20-Poly1305 otherwise (``SDS_ALGORITHM`` pins either).
+"""
+
+import ctypes
+import functools
+import hmac
+import logging
+import os
+import struct
+import sys
+
+logger = logging.getLogger(__name__)
+
+CHACHA20_POLY1305 = "CHACHA20_POLY1305"
+AES_256_GCM = "AES_256_GCM"
+ALGORITHMS = (CHACHA20_POLY1305, AES_256_GCM)
+
+NONCE_SIZE = 12
+TAG_SIZE = 16
+
+
+class CryptoError(Exception):
+    """Base class for SDS encryption failures."""
+
+
+class DecryptionError(CryptoError):
+    """The ciphertext is malformed or failed authentication."""
+
+
+class _PyBuffer(ctypes.Structure):
+    _fields_ = [
+        ("buf", ctypes.c_void_p),
+        ("obj", ctypes.c_void_p),
+        ("len", ctypes.c_ssize_t),
+        ("itemsize", ctypes.c_ssize_t),
+        ("readonly", ctypes.c_int),
+        ("ndim", ctypes.c_int),
+        ("format", ctypes.c_char_p),
+        ("shape", ctypes.c_void_p),
+        ("strides", ctypes.c_void_p),
+        ("suboffsets", ctypes.c_void_p),
+        ("internal", ctypes.c_void_p),
+    ]
+
+
+_get_buffer = ctypes.pythonapi.PyObject_GetBuffer
+_get_buffer.argtypes = [ctypes.py_object, ctypes.POINTER(_PyBuffer), ctypes.c_int]
+_release_buffer = ctypes.pythonapi.PyBuffer_Release
+_release_buffer.argtypes = [ctypes.POINTER(_PyBuffer)]
+_PYBUF_WRITABLE = 0x0001
+
+
+class _Pinned:
+    """Address of any contiguous buffer, read-only ones included, no copy."""
+
+    __slots__ = ("_view",)
+
+    def __init__(self, data, writable=False):
+        self._view = _PyBuffer()
+        flags = _PYBUF_WRITABLE if writable else 0
+        _get_buffer(data, ctypes.byref(self._view), flags)
+
+    def __enter__(self):
+        return self._view.buf or 0, self._view.len
+
+    def __exit__(self, exc_type, exc, tb):
+        _release_buffer(ctypes.byref(self._view))
+        return False
+
+
+class _RowCipher:
+    """Row-at-a-time bulk operations over a whole column's buffers.
+
+    ``values[starts[i]:ends[i]]`` is row ``i``.  Ciphers whose library can
+    be driven by address override these loops.
+    """
+
+    __slots__ = ()
+
+    def seal_rows(self, rows, values, starts, ends, aad, out, positions):
+        """Seal row ``i`` under the nonce already at ``out[positions[i]:]``.
+
+        The ciphertext and tag are written right after the nonce.
+        """
+        values, out = memoryview(values).cast("B"), memoryview(out)
+        for i in rows:
+            nonce = positions[i]
+            sealed = self.seal(
+                out[nonce : nonce + NONCE_SIZE], values[starts[i] : ends[i]], aad
+            )
+            out[nonce + NONCE_SIZE : nonce + NONCE_SIZE + len(sealed)] = sealed
+
+    def open_rows(self, rows, values, starts, ends, aad, out, positions):
+        """Open row ``i``, a nonce then ciphertext and tag, into ``out[positions[i]:]``.
+
+        Returns the first row that is too short or fails authentication, or
+        ``None``.
+        """
+        values, out = memoryview(values).cast("B"), memoryview(out)
+        for i in rows:
+            start, end = starts[i], ends[i]
+            size = end - start - NONCE_SIZE - TAG_SIZE
+            if size < 0:
+                return i
+            nonce, sealed = start + NONCE_SIZE, values[start + NONCE_SIZE : end]
+            try:
+                self.open(values[start:nonce], sealed, aad, out[positions[i] :][:size])
+            except DecryptionError:
+                return i
+        return None
+
+
+# -- pure Python -------------------------------------------------------------
+
+_MASK32 = 0xFFFFFFFF
+_SIGMA = (0x61707865, 0x3320646E, 0x79622D32, 0x6B206574)
+_POLY1305_P = (1 << 130) - 5
+_POLY1305_CLAMP = 0x0FFFFFFC0FFFFFFC0FFFFFFC0FFFFFFF
+
+
+def _quarter_round(x, a, b, c, d):
+    x[a] = (x[a] + x[b]) & _MASK32
+    x[d] ^= x[a]
+    x[d] = ((x[d] << 16) & _MASK32) | (x[d] >> 16)
+    x[c] = (x[c] + x[d]) & _MASK32
+    x[b] ^= x[c]
+    x[b] = ((x[b] << 12) & _MASK32) | (x[b] >> 20)
+    x[a] = (x[a] + x[b]) & _MASK32
+    x[d] ^= x[a]
+    x[d] = ((x[d] << 8) & _MASK32) | (x[d] >> 24)
+    x[c] = (x[c] + x[d]) & _MASK32
+    x[b] ^= x[c]
+    x[b] = ((x[b] << 7) & _MASK32) | (x[b] >> 25)
+
+
+def _chacha20_keystream(key, counter, nonce, size):
+    key_words = struct.unpack("<8L", key)
+    nonce_words = struct.unpack("<3L", nonce)
+    blocks = []
+    for block in range((size + 63) // 64):
+        state = [*_SIGMA, *key_words, (counter + block) & _MASK32, *nonce_words]
+        x = list(state)
+        for _ in range(10):
+            _quarter_round(x, 0, 4, 8, 12)
+            _quarter_round(x, 1, 5, 9, 13)
+            _quarter_round(x, 2, 6, 10, 14)
+            _quarter_round(x, 3, 7, 11, 15)
+            _quarter_round(x, 0, 5, 10, 15)
+            _quarter_round(x, 1, 6, 11, 12)
+            _quarter_round(x, 2, 7, 8, 13)
+            _quarter_round(x, 3, 4, 9, 14)
+        words = ((a + b) & _MASK32 for a, b in zip(x, state))
+        blocks.append(struct.pack("<16L", *words))
+    return b"".join(blocks)[:size]
+
+
+def _chacha20_xor(key, counter, nonce, data):
+    if not data:
+        return b""
+    stream = _chacha20_keystream(key, counter, nonce, len(data))
+    mixed = int.from_bytes(data, "little") ^ int.from_bytes(stream, "little")
+    return mixed.to_bytes(len(data), "little")
+
+
+def _poly1305(key, message):
+    r = int.from_bytes(key[:16], "little") & _POLY1305_CLAMP
+    s = int.from_bytes(key[16:32], "little")
+    acc = 0
+    for offset in range(0, len(message), 16):
+        block = message[offset : offset + 16] + b"\x01"
+        acc = (acc + int.from_bytes(block, "little")) * r % _POLY1305_P
+    return ((acc + s) & ((1 << 128) - 1)).to_bytes(16, "little")
+
+
+def _aead_tag(key, nonce, ciphertext, aad):
+    one_time_key = _chacha20_keystream(key, 0, nonce, 32)
+    mac_data = b"".join(
+        (
+            aad,
+            bytes(-len(aad) % 16),
+            ciphertext,
+            bytes(-len(ciphertext) % 16),
+            struct.pack("<QQ", len(aad), len(ciphertext)),
+        )
+    )
+    return _poly1305(one_time_key, mac_data)
+
+
+class _PythonCipher(_RowCipher):
+    __slots__ = ("_key",)
+
+    def __init__(self, key):
+        self._key = bytearray(key)
+
+    def seal(self, nonce, plaintext, aad=b""):
+        nonce, aad = bytes(nonce), bytes(aad)
+        ciphertext = _chacha20_xor(self._key, 1, nonce, bytes(plaintext))
+        return ciphertext + _aead_tag(self._key, nonce, ciphertext, aad)
+
+    def open(self, nonce, sealed, aad, out):
+        nonce, aad, sealed = bytes(nonce), bytes(aad), bytes(sealed)
+        ciphertext, tag = sealed[:-TAG_SIZE], sealed[-TAG_SIZE:]
+        if not hmac.compare_digest(tag, _aead_tag(self._key, nonce, ciphertext, aad)):
+            raise DecryptionError("authentication tag mismatch")
+        out[:] = _chacha20_xor(self._key, 1, nonce, ciphertext)
+
+    def close(self):
+        self._key[:] = bytes(len(self._key))
+
+
+class PythonBackend:
+    name = "python"
+    algorithms = frozenset({CHACHA20_POLY1305})
+
+    def aead(self, algorithm, key):
+        return _PythonCipher(key)
+
+
+# -- OpenSSL EVP -------------------------------------------------------------
+
+_EVP_CTRL_AEAD_GET_TAG = 0x10
+_EVP_CTRL_AEAD_SET_TAG = 0x11
+_LIBCRYPTO_NAMES = ("libcrypto.so.3", "libcrypto.so.1.1", "libcrypto.3.dylib")
+
+
+def _open_libcrypto(name):
+    try:
+        lib = ctypes.CDLL(name)
+    except OSError:
+        return None
+    return lib if hasattr(lib, "EVP_chacha20_poly1305") else None
+
+
+def _load_libcrypto():
+    for name in _LIBCRYPTO_NAMES:
+        lib = _open_libcrypto(name)
+        if lib is not None:
+            return lib
+    # find_library shells out to ldconfig, so it is only the last resort.
+    import ctypes.util
+
+    found = ctypes.util.find_library("crypto")
+    lib = _open_libcrypto(found) if found else None
+    if lib is None:
+        raise OSError("libcrypto with EVP AEAD support not found")
+    return lib
+
+
+def _declare(lib):
+    ptr, size, out_len = ctypes.c_void_p, ctypes.c_int, ctypes.POINTER(ctypes.c_int)
+    lib.EVP_CIPHER_CTX_new.restype = ptr
+    lib.EVP_CIPHER_CTX_free.argtypes = [ptr]
+    lib.EVP_CIPHER_CTX_ctrl.argtypes = [ptr, size, size, ptr]
+    lib.EVP_chacha20_poly1305.restype = ptr
+    lib.EVP_aes_256_gcm.restype = ptr
+    for direction in ("Encrypt", "Decrypt"):
+        init = getattr(lib, f"EVP_{direction}Init_ex")
+        init.argtypes = [ptr, ptr, ptr, ptr, ptr]
+        update = getattr(lib, f"EVP_{direction}Update")
+        update.argtypes = [ptr, ptr, out_len, ptr, size]
+        final = getattr(lib, f"EVP_{direction}Final_ex")
+        final.argtypes = [ptr, ptr, out_len]
+    if hasattr(lib, "OpenSSL_version"):
+        lib.OpenSSL_version.restype = ctypes.c_char_p
+        lib.OpenSSL_version.argtypes = [size]
+
+
+def _check(result):
+    if result != 1:
+        raise CryptoError("OpenSSL EVP call failed")
+
+
+class _EVPCipher(_RowCipher):
+    """Encrypt and decrypt contexts keyed once; each message only sets a nonce."""
+
+    __slots__ = ("_lib", "_enc", "_dec")
+
+    def __init__(self, lib, cipher, key):
+        self._lib = lib
+        self._enc = lib.EVP_CIPHER_CTX_new()
+        self._dec = lib.EVP_CIPHER_CTX_new()
+        with _Pinned(key) as (key_ptr, _):
+            _check(lib.EVP_EncryptInit_ex(self._enc, cipher, None, key_ptr, None))
+            _check(lib.EVP_DecryptInit_ex(self._dec, cipher, None, key_ptr, None))
+
+    def seal(self, nonce, plaintext, aad=b""):
+        lib, ctx, written = self._lib, self._enc, ctypes.c_int()
+        with _Pinned(nonce) as (nonce_ptr, _):
+            _check(lib.EVP_EncryptInit_ex(ctx, None, None, None, nonce_ptr))
+        if aad:
+            with _Pinned(aad) as (aad_ptr, aad_size):
+                _check(lib.EVP_EncryptUpdate(ctx, None, written, aad_ptr, aad_size))
+        with _Pinned(plaintext) as (data_ptr, size):
+            out = ctypes.create_string_buffer(size + TAG_SIZE)
+            _check(lib.EVP_EncryptUpdate(ctx, out, written, data_ptr, size))
+        tag = ctypes.addressof(out) + size
+        _check(lib.EVP_EncryptFinal_ex(ctx, tag, written))
+        _check(lib.EVP_CIPHER_CTX_ctrl(ctx, _EVP_CTRL_AEAD_GET_TAG, TAG_SIZE, tag))
+        return out.raw
+
+    def open(self, nonce, sealed, aad, out):
+        lib, ctx, written = self._lib, self._dec, ctypes.c_int()
+        with _Pinned(nonce) as (nonce_ptr, _):
+            _check(lib.EVP_DecryptInit_ex(ctx, None, None, None, nonce_ptr))
+        if aad:
+            with _Pinned(aad) as (aad_ptr, aad_size):
+                _check(lib.EVP_DecryptUpdate(ctx, None, written, aad_ptr, aad_size))
+        with _Pinned(sealed) as (data_ptr, total), _Pinned(out, True) as (out_ptr, _):
+            size = total - TAG_SIZE
+            _check(lib.EVP_DecryptUpdate(ctx, out_ptr, written, data_ptr, size))
+            tag = data_ptr + size
+            _check(lib.EVP_CIPHER_CTX_ctrl(ctx, _EVP_CTRL_AEAD_SET_TAG, TAG_SIZE, tag))
+            if lib.EVP_DecryptFinal_ex(ctx, out_ptr + size, written) != 1:
+                ctypes.memset(out_ptr, 0, size)
+                raise DecryptionError("authentication tag mismatch")
+
+    def seal_rows(self, rows, values, starts, ends, aad, out, positions):
+        lib, ctx, written = self._lib, self._enc, ctypes.c_int()
+        init, update = lib.EVP_EncryptInit_ex, lib.EVP_EncryptUpdate
+        final, ctrl = lib.EVP_EncryptFinal_ex, lib.EVP_CIPHER_CTX_ctrl
+        with _Pinned(values) as (base, _), _Pinned(aad) as (aad_ptr, aad_size):
+            with _Pinned(out, True) as (out_ptr, _):
+                for i in rows:
+                    start = starts[i]
+                    size = ends[i] - start
+                    nonce = out_ptr + positions[i]
+                    sealed = nonce + NONCE_SIZE
+                    ok = init(ctx, None, None, None, nonce)
+                    if aad_size:
+                        ok &= update(ctx, None, written, aad_ptr, aad_size)
+                    ok &= update(ctx, sealed, written, base + start, size)
+                    ok &= final(ctx, sealed + size, written)
+                    ok &= ctrl(ctx, _EVP_CTRL_AEAD_GET_TAG, TAG_SIZE, sealed + size)
+                    _check(ok)
+
+    def open_rows(self, rows, values, starts, ends, aad, out, positions):
+        lib, ctx, written = self._lib, self._dec, ctypes.c_int()
+        init, update = lib.EVP_DecryptInit_ex, lib.EVP_DecryptUpdate
+        final, ctrl = lib.EVP_DecryptFinal_ex, lib.EVP_CIPHER_CTX_ctrl
+        with _Pinned(values) as (base, _), _Pinned(aad) as (aad_ptr, aad_size):
+            with _Pinned(out, True) as (out_ptr, _):
+                for i in rows:
+                    nonce = base + starts[i]
+                    size = base + ends[i] - nonce - NONCE_SIZE - TAG_SIZE
+                    if size < 0:
+                        return i
+                    sealed, plain = nonce + NONCE_SIZE, out_ptr + positions[i]
+                    ok = init(ctx, None, None, None, nonce)
+                    if aad_size:
+                        ok &= update(ctx, None, written, aad_ptr, aad_size)
+                    ok &= update(ctx, plain, written, sealed, size)
+                    ok &= ctrl(ctx, _EVP_CTRL_AEAD_SET_TAG, TAG_SIZE, sealed + size)
+                    _check(ok)
+                    if final(ctx, plain + size, written) != 1:
+                        ctypes.memset(plain, 0, size)
+                        return i
+        return None
+
+    def close(self):
+        """Free both contexts; OpenSSL cleanses the expanded key schedules."""
+        for name in ("_enc", "_dec"):
+            ctx = getattr(self, name, None)
+            if ctx:
+                self._lib.EVP_CIPHER_CTX_free(ctx)
+            setattr(self, name, None)
+
+    __del__ = close
+
+
+class OpenSSLBackend:
+    name = "openssl"
+    algorithms = frozenset(ALGORITHMS)
+
+    def __init__(self):
+        self._lib = _load_libcrypto()
+        _declare(self._lib)
+        self._ciphers = {
+            CHACHA20_POLY1305: self._lib.EVP_chacha20_poly1305(),
+            AES_256_GCM: self._lib.EVP_aes_256_gcm(),
+        }
+        version = getattr(self._lib, "OpenSSL_version", None)
+        self.version = version(0).decode() if version else "unknown"
+
+    def aead(self, algorithm, key):
+        return _EVPCipher(self._lib, self._ciphers[algorithm], key)
+
+
+# -- cryptography ------------------------------------------------------------
+
+
+class _CryptographyCipher(_RowCipher):
+    __slots__ = ("_impl", "_invalid_tag")
+
+    def __init__(self, impl, invalid_tag):
+        self._impl = impl
+        self._invalid_tag = invalid_tag
+
+    def seal(self, nonce, plaintext, aad=b""):
+        return self._impl.encrypt(bytes(nonce), plaintext, aad or None)
+
+    def open(self, nonce, sealed, aad, out):
+        try:
+            out[:] = self._impl.decrypt(bytes(nonce), sealed, aad or None)
+        except self._invalid_tag:
+            raise DecryptionError("authentication tag mismatch") from None
+
+    def close(self):
+        self._impl = None
+
+
+class CryptographyBackend:
+    name = "cryptography"
+    algorithms = frozenset(ALGORITHMS)
+
+    def __init__(self):
+        from cryptography.exceptions import InvalidTag
+        from cryptography.hazmat.primitives.ciphers import aead
+
+        self._invalid_tag = InvalidTag
+        self._classes = {
+            CHACHA20_POLY1305: aead.ChaCha20Poly1305,
+            AES_256_GCM: aead.AESGCM,
+        }
+
+    def aead(self, algorithm, key):
+        impl = self._classes[algorithm](bytes(key))
+        return _CryptographyCipher(impl, self._invalid_tag)
+
+
+# -- selection ---------------------------------------------------------------
+
+BACKENDS = {
+    "openssl": OpenSSLBackend,
+    "cryptography": CryptographyBackend,
+    "python": PythonBackend,
+}
+
+_loaded = {}
+_backend = None
+
+
+def load_backend(name):
+    """Instantiate backend ``name`` once; raises ``ImportError``/``OSError``."""
+    if name not in _loaded:
+        _loaded[name] = BACKENDS[name]()
+    return _loaded[name]
+
+
+def available_backends():
+    names = []
+    for name in BACKENDS:
+        try:
+            load_backend(name)
+        except (ImportError, OSError):
+            continue
+        names.append(name)
+    return names
+
+
+def _auto_select():
+    for name in BACKENDS:
+        try:
+            return load_backend(name)
+        except (ImportError, OSError) as exc:
+            logger.debug("SDS crypto backend %s unavailable: %s", name, exc)
+    raise CryptoError("no crypto backend available")
+
+
+def get_backend():
+    global _backend
+    if _backend is None:
+        name = os.environ.get("SDS_CRYPTO_BACKEND")
+        _backend = load_backend(name) if name else _auto_select()
+        logger.debug("SDS crypto backend: %s", _backend.name)
+    return _backend
+
+
+def set_backend(backend):
+    """Force a backend by name or instance; ``None`` restores auto-selection."""
+    global _backend
+    _backend = load_backend(backend) if isinstance(backend, str) else backend
+
+
+def cipher(algorithm, key):
+    """A keyed AEAD for ``algorithm`` from the selected backend.
+
+    Algorithms the selected backend lacks (AES-GCM under the pure-Python
+    backend) are served by the first backend that has them.
+    """
+    backend = get_backend()
+    if algorithm not in backend.algorithms:
+        for name in available_backends():
+            if algorithm in load_backend(name).algorithms:
+                backend = load_backend(name)
+                break
+        else:
+            raise CryptoError(f"no backend supports {algorithm}")
+    return backend.aead(algorithm, key)
+
+
+def _parse_cpu_features(cpuinfo, system, machine):
+    flags = set()
+    for line in cpuinfo.splitlines():
+        key, _, value = line.partition(":")
+        if key.strip() in ("flags", "Features"):
+            flags.update(value.split())
+            break
+    if system == "darwin" and machine == "arm64":
+        flags.update(("aes", "pmull", "asimd"))
+    features = set()
+    if "aes" in flags:
+        features.add("aes")
+    if "pclmulqdq" in flags or "pmull" in flags:
+        features.add("clmul")
+    if {"vaes", "vpclmulqdq"} <= flags:
+        features.add("vaes")
+    if "avx2" in flags or "asimd" in flags:
+        features.add("simd")
+    return frozenset(features)
+
+
+@functools.lru_cache(maxsize=None)
+def cpu_features():
+    """Crypto-relevant CPU features: ``aes``, ``clmul``, ``vaes``, ``simd``."""
+    try:
+        with open("/proc/cpuinfo") as cpuinfo:
+            text = cpuinfo.read()
+    except OSError:
+        text = ""
+    machine = os.uname().machine.lower() if hasattr(os, "uname") else ""
+    return _parse_cpu_features(text, sys.platform, machine)
+
+
+def default_algorithm():
+    """Algorithm for new ciphertext on this host."""
+    pinned = os.environ.get("SDS_ALGORITHM")
+    if pinned:
+        if pinned not in ALGORITHMS:
+            allowed = ", ".join(ALGORITHMS)
+            raise ValueError(f"SDS_ALGORITHM must be one of {allowed}, not {pinned!r}")
+        return pinned
+    if {"aes", "clmul"} <= cpu_features():
+        if AES_256_GCM in get_backend().algorithms:
+            return AES_256_GCM
+    return CHACHA20_POLY1305
+
+
+def describe():
+    """The active backend and algorithm, for logs and benchmark reports."""
+    backend = get_backend()
+    return {
+        "backend": backend.name,
+        "version": getattr(backend, "version", None),
+        "algorithm": default_algorithm(),
+        "cpu_features": sorted(cpu_features()),
+    }
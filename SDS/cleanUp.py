@@ -0,0 +1,414 @@
+"""Wiping of secret material and the SDS cleanup lifecycle.
+
+Modules that hold secrets register hooks here instead of being imported by
+this module, so ``cleanUp`` stays a leaf that everything else can depend on.
+
+* invocation hooks run from :func:`clean_up` at the end of every invocation;
+* shutdown hooks run from :func:`shutdown` when the container is recycled
+  (interpreter exit or ``SIGTERM``);
+* snapshot and restore hooks run from :func:`before_snapshot` and
+  :func:`after_restore` around a Lambda SnapStart or CRIU snapshot, which is
+  restored into many containers at once.
+
+Individual secret-bearing objects that must not outlive the invocation are
+registered with :func:`track`.  The registry only holds weak references to
+the current generation's objects, so cleanup costs one ``close()`` per secret
+touched in this invocation rather than a walk over the whole heap.
+
+Resources built from a secret that should outlive the invocation -- a warm
+connection pool authenticated with a database password -- are instead
+bound to the secret's version with :func:`bind`.  They are closed only by
+:func:`invalidate` for that version or when the container shuts down.
+
+``clean_up(defer=True)`` takes the invocation hooks off the response path:
+they run on a background thread, and :func:`begin_invocation` -- called by
+:func:`SDS.secureBuffer.allocate` before any new plaintext is produced --
+blocks until they have finished.  :mod:`SDS.lambdaExtension` keeps the
+sandbox from being frozen while a deferred cleanup is still running.
+
+For audits, ``SDS_WIPE_VERIFY`` samples that fraction of invocations (say
+``0.01``) whose cleanup is followed by a scan of what it should have left
+zeroed and is still resident: every object tracked in the invocation and
+whatever :func:`register_wipe_check` hooks report, such as the whole
+secret arena.  Results are reported as the ``wipe_checks``,
+``wipe_checked_bytes`` and ``wipe_failures`` metrics.
+"""
+
+import atexit
+import collections
+import ctypes
+import logging
+import os
+import signal
+import threading
+import weakref
+
+from . import metrics
+
+logger = logging.getLogger(__name__)
+
+_lock = threading.Lock()
+_invocation_hooks = []
+_shutdown_hooks = []
+_wipe_checks = []
+_snapshot_hooks = []
+_restore_hooks = []
+_atexit_installed = False
+_snapshot_installed = False
+
+_state = threading.Condition()
+_cleanup_thread = None
+_defers = False
+_completed = collections.deque(maxlen=64)
+
+generation = 0
+_tracked = weakref.WeakSet()
+_bindings = {}
+
+verify_rate = float(os.environ.get("SDS_WIPE_VERIFY", "0"))
+_ZERO_BLOCK_SIZE = 64 * 1024
+_zero_block = None
+_memcmp = ctypes.CDLL(None).memcmp
+_memcmp.argtypes = (ctypes.c_void_p, ctypes.c_void_p, ctypes.c_size_t)
+_memcmp.restype = ctypes.c_int
+
+
+def wipe(buf):
+    """Overwrite a writable bytes-like object with zeros in place."""
+    view = memoryview(buf)
+    if view.readonly:
+        raise TypeError("cannot wipe a read-only buffer")
+    view = view.cast("B")
+    size = view.nbytes
+    if size:
+        ctypes.memset((ctypes.c_char * size).from_buffer(view), 0, size)
+    view.release()
+
+
+def verify_wiped(buf):
+    """Check that a writable bytes-like object reads as all zeros.
+
+    Compares it with ``memcmp`` against one fixed zero block, so the scan
+    runs at libc's vectorised speed in constant memory.  Residue is logged
+    by address only, never by content, and counted in ``wipe_failures``.
+    """
+    global _zero_block
+    if _zero_block is None:
+        _zero_block = ctypes.create_string_buffer(_ZERO_BLOCK_SIZE)
+    view = memoryview(buf).cast("B")
+    size = view.nbytes
+    clean = True
+    address = 0
+    if size:
+        anchor = (ctypes.c_char * size).from_buffer(view)
+        address = ctypes.addressof(anchor)
+        for offset in range(0, size, _ZERO_BLOCK_SIZE):
+            length = min(_ZERO_BLOCK_SIZE, size - offset)
+            if _memcmp(address + offset, _zero_block, length):
+                clean = False
+                break
+        del anchor
+    view.release()
+    metrics.count("wipe_checked_bytes", size)
+    if not clean:
+        metrics.count("wipe_failures")
+        logger.error("SDS wipe left data in %d bytes at %#x", size, address)
+    return clean
+
+
+def register_wipe_check(check):
+    """Have ``check()`` list buffers that must read as zeros after cleanup.
+
+    Called only in invocations sampled by ``SDS_WIPE_VERIFY``, once every
+    invocation hook has run.
+    """
+    with _lock:
+        _wipe_checks.append(check)
+    return check
+
+
+def _verify(closed):
+    metrics.count("wipe_checks")
+    resident = [obj.resident() for obj in closed if hasattr(obj, "resident")]
+    with _lock:
+        checks = list(_wipe_checks)
+    for check in checks:
+        try:
+            resident.extend(check())
+        except Exception:
+            logger.exception("SDS wipe check %r failed", check)
+    for buf in resident:
+        if buf is not None:
+            verify_wiped(buf)
+
+
+def _sampled():
+    if verify_rate <= 0:
+        return False
+    if verify_rate >= 1:
+        return True
+    import random
+
+    return random.random() < verify_rate
+
+
+def track(obj):
+    """Close ``obj`` at the end of the current invocation, unless freed first.
+
+    ``obj`` needs a ``close()`` that wipes it and must support weak
+    references; it is returned for convenience.
+    """
+    with _lock:
+        _tracked.add(obj)
+    return obj
+
+
+def _close_tracked():
+    global generation, _tracked
+    with _lock:
+        tracked = _tracked
+        generation += 1
+        if not tracked:
+            return []
+        _tracked = weakref.WeakSet()
+    closed = list(tracked)
+    for obj in closed:
+        try:
+            obj.close()
+        except Exception:
+            logger.exception("SDS could not close %r", obj)
+    if closed:
+        metrics.count("secrets_closed", len(closed))
+    return closed
+
+
+def bind(version, close):
+    """Call ``close()`` once secret ``version`` is invalidated, or at shutdown.
+
+    Per-invocation cleanup leaves bound resources alone.  Returns ``close``.
+    """
+    with _lock:
+        _bindings.setdefault(version, []).append(close)
+        _install_atexit()
+    return close
+
+
+def invalidate(version):
+    """Close everything bound to secret ``version``; returns how many."""
+    with _lock:
+        closers = _bindings.pop(version, [])
+    return _close_bound(closers)
+
+
+def _close_bound(closers):
+    for close in closers:
+        try:
+            close()
+        except Exception:
+            logger.exception("SDS could not close %r", close)
+    if closers:
+        metrics.count("bindings_closed", len(closers))
+    return len(closers)
+
+
+def _invalidate_all():
+    with _lock:
+        bindings = list(_bindings.values())
+        _bindings.clear()
+    _close_bound([close for closers in bindings for close in closers])
+
+
+def register_invocation_hook(hook):
+    """Run ``hook()`` from every :func:`clean_up` call."""
+    with _lock:
+        _invocation_hooks.append(hook)
+    return hook
+
+
+def register_shutdown_hook(hook):
+    """Run ``hook()`` once when the container shuts down."""
+    with _lock:
+        _shutdown_hooks.append(hook)
+        _install_atexit()
+    return hook
+
+
+def register_snapshot_hook(hook):
+    """Run ``hook()`` from :func:`before_snapshot`."""
+    with _lock:
+        _snapshot_hooks.append(hook)
+    return hook
+
+
+def register_restore_hook(hook):
+    """Run ``hook()`` from :func:`after_restore`."""
+    with _lock:
+        _restore_hooks.append(hook)
+    return hook
+
+
+def _install_atexit():
+    global _atexit_installed
+    if not _atexit_installed:
+        atexit.register(shutdown)
+        _atexit_installed = True
+
+
+def _run_hooks(hooks):
+    with _lock:
+        hooks = list(hooks)
+    for hook in hooks:
+        # One failing hook must not leave the remaining secrets in memory.
+        try:
+            hook()
+        except Exception:
+            logger.exception("SDS cleanup hook %r failed", hook)
+
+
+def clean_up(defer=False, request_id=None):
+    """End-of-invocation cleanup: drop expired keys and other per-call state.
+
+    Also emits the invocation's timing breakdown when metrics are enabled.
+    With ``defer=True`` this returns at once and the work happens on a
+    background thread; call it once the response is ready, passing
+    ``context.aws_request_id`` so :mod:`SDS.lambdaExtension` can tell when
+    this invocation's wipe is done.
+    """
+    global _cleanup_thread, _defers
+    begin_invocation()
+    if not defer:
+        _clean_up(request_id)
+        return
+    _defers = True
+    thread = threading.Thread(
+        target=_clean_up, args=(request_id,), name="sds-cleanup", daemon=True
+    )
+    with _state:
+        _cleanup_thread = thread
+    thread.start()
+
+
+def _clean_up(request_id):
+    global _cleanup_thread
+    try:
+        with metrics.timer("cleanup"):
+            closed = _close_tracked()
+            _run_hooks(_invocation_hooks)
+            if _sampled():
+                _verify(closed)
+            del closed
+        if metrics.enabled:
+            metrics.emit()
+    finally:
+        with _state:
+            if _cleanup_thread is threading.current_thread():
+                _cleanup_thread = None
+            if request_id is not None:
+                _completed.append(request_id)
+            _state.notify_all()
+
+
+def begin_invocation(timeout=None):
+    """Wait for the previous invocation's deferred cleanup to finish.
+
+    Raises ``TimeoutError`` if it is still running after ``timeout`` seconds.
+    """
+    thread = _cleanup_thread
+    if thread is None or thread is threading.current_thread():
+        return
+    with _state:
+        if not _state.wait_for(lambda: _cleanup_thread is None, timeout):
+            raise TimeoutError("previous invocation's cleanup is still running")
+
+
+def expect_deferred():
+    """Declare during INIT that handlers will call ``clean_up(defer=True)``.
+
+    :mod:`SDS.lambdaExtension` only holds the sandbox in a process that
+    defers its cleanup.  A deferred :func:`clean_up` says so itself, but not
+    before the first invocation has already been let go.
+    """
+    global _defers
+    _defers = True
+
+
+def deferring():
+    """Whether a cleanup may still be running after its handler returns."""
+    return _defers or _cleanup_thread is not None
+
+
+def wait_for_cleanup(request_id, timeout=None):
+    """Wait until :func:`clean_up` has finished for ``request_id``."""
+    with _state:
+        return _state.wait_for(lambda: request_id in _completed, timeout)
+
+
+def shutdown():
+    """Container-recycle cleanup: wipe everything SDS still holds."""
+    try:
+        begin_invocation(timeout=1.0)
+    except TimeoutError:
+        logger.warning("SDS deferred cleanup still running at shutdown")
+    _close_tracked()
+    _invalidate_all()
+    _run_hooks(_invocation_hooks)
+    _run_hooks(_shutdown_hooks)
+
+
+def before_snapshot():
+    """Wipe what no snapshot may carry into the containers restored from it.
+
+    Plaintext keys and secrets go; wrapped keys, envelopes and the loaded
+    crypto backend stay, so a restored container decrypts again on first
+    use without repeating the rest of INIT.  Warm connection pools are
+    closed too, as their sockets would not survive a restore.
+    """
+    begin_invocation()
+    _close_tracked()
+    _invalidate_all()
+    _run_hooks(_invocation_hooks)
+    _run_hooks(_snapshot_hooks)
+
+
+def after_restore():
+    """Give a restored container state of its own, e.g. fresh RNG seeds."""
+    _run_hooks(_restore_hooks)
+
+
+def install_snapshot_hooks():
+    """Run :func:`before_snapshot` and :func:`after_restore` under SnapStart.
+
+    Registers them with ``snapshot_restore_py``, which the Lambda Python
+    runtime provides; returns ``False`` when it is missing, in which case
+    call both from the platform's own checkpoint hooks (CRIU action
+    scripts, say).  Registering twice is a no-op.
+    """
+    global _snapshot_installed
+    try:
+        import snapshot_restore_py
+    except ImportError:
+        return False
+    with _lock:
+        if not _snapshot_installed:
+            snapshot_restore_py.register_before_snapshot(before_snapshot)
+            snapshot_restore_py.register_after_restore(after_restore)
+            _snapshot_installed = True
+    return True
+
+
+def install_signal_handlers():
+    """Run :func:`shutdown` on ``SIGTERM`` before the previous handler.
+
+    Lambda delivers ``SIGTERM`` before recycling a sandbox that has an
+    extension registered; other container platforms do so on scale-in.
+    """
+    previous = signal.getsignal(signal.SIGTERM)
+
+    def _on_sigterm(signum, frame):
+        shutdown()
+        if callable(previous):
+            previous(signum, frame)
+        elif previous != signal.SIG_IGN:
+            raise SystemExit(128 + signum)
+
+    signal.signal(signal.SIGTERM, _on_sigterm)
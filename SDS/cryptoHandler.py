@@ -0,0 +1,2606 @@
+"""Envelope encryption for SDS secure variables.
+
+Every message is sealed with an AEAD -- AES-256-GCM where the CPU accelerates
+it, ChaCha20-Poly1305 (RFC 8439) otherwise, see :mod:`SDS.backends` -- under a
+one-off key derived with HKDF-SHA256 from a 256-bit data key.  Data keys are
+generated and wrapped by a :class:`KeyProvider` -- AWS KMS in production -- and
+only the wrapped copy travels with the ciphertext.
+
+Unwrapped data keys are kept in a per-container :class:`DataKeyCache`, so warm
+invocations of the same function instance skip the KMS round-trip.  The cache
+is cleared through :mod:`SDS.cleanUp`.
+"""
+
+import array
+import base64
+import collections
+import functools
+import hashlib
+import hmac
+import json
+import itertools
+import math
+import operator
+import os
+import struct
+import sys
+import threading
+import time
+import weakref
+import zlib
+
+from . import backends, cleanUp, metrics
+from .backends import AES_256_GCM, CHACHA20_POLY1305, CryptoError, DecryptionError
+
+KEY_SIZE = 32
+NONCE_SIZE = backends.NONCE_SIZE
+TAG_SIZE = backends.TAG_SIZE
+SALT_SIZE = 16
+
+# Version 1 envelopes were JSON with base64 fields; they are still read.
+ENVELOPE_VERSION = 2
+# version, algorithm id, key version, key ID length, wrapped key length; then
+# the key ID, wrapped key, salt, nonce and ciphertext with its trailing tag.
+_ENVELOPE_FIXED = struct.Struct(">BBBHH")
+
+# Algorithm ids shared by envelopes and stream headers.
+_ALGORITHMS = {1: CHACHA20_POLY1305, 2: AES_256_GCM}
+_ALGORITHM_IDS = {name: ident for ident, name in _ALGORITHMS.items()}
+
+
+def aead_seal(key, nonce, plaintext, aad=b"", algorithm=CHACHA20_POLY1305):
+    """AEAD encrypt; returns ``ciphertext || tag``."""
+    return backends.cipher(algorithm, key).seal(nonce, plaintext, aad)
+
+
+def aead_open(
+    key, nonce, sealed, aad=b"", alloc=bytearray, algorithm=CHACHA20_POLY1305
+):
+    """AEAD decrypt ``ciphertext || tag``.
+
+    The plaintext is written into ``alloc(size)``, a writable buffer such as
+    a :class:`~SDS.secureBuffer.SecureBuffer`, which is returned.
+    """
+    return _open_with(backends.cipher(algorithm, key), nonce, sealed, aad, alloc)
+
+
+def _open_with(cipher, nonce, sealed, aad, alloc):
+    if len(sealed) < TAG_SIZE:
+        raise DecryptionError("ciphertext is shorter than the tag")
+    out = alloc(len(sealed) - TAG_SIZE)
+    try:
+        cipher.open(nonce, sealed, aad, _writable(out))
+    except DecryptionError:
+        # Backends leave nothing in ``out``; hand its slot back straight away.
+        if hasattr(out, "close"):
+            out.close()
+        raise
+    return out
+
+
+def _writable(buffer):
+    writable = getattr(buffer, "writable", None)
+    return writable() if writable is not None else memoryview(buffer)
+
+
+def hkdf(key, salt, info, length=KEY_SIZE):
+    """HKDF-SHA256 (RFC 5869) into a ``bytearray``."""
+    prk = hmac.new(bytes(salt), bytes(key), hashlib.sha256).digest()
+    okm = bytearray()
+    block = b""
+    counter = 1
+    while len(okm) < length:
+        block = hmac.new(prk, block + info + bytes((counter,)), hashlib.sha256).digest()
+        okm += block
+        counter += 1
+    del okm[length:]
+    return okm
+
+
+class KeyProvider:
+    """Source of wrapped data keys; subclasses talk to a key service."""
+
+    def generate_data_key(self, key_id):
+        """Return ``(plaintext_key, wrapped_key)`` for master key ``key_id``."""
+        raise NotImplementedError
+
+    def decrypt_data_key(self, key_id, wrapped_key):
+        """Unwrap ``wrapped_key`` into a ``bytearray``."""
+        raise NotImplementedError
+
+    def rewrap_data_key(self, key_id, wrapped_key, new_key_id):
+        """Re-wrap a data key from master key ``key_id`` under ``new_key_id``."""
+        raise NotImplementedError
+
+    # Async counterparts default to running the blocking call on the
+    # key-fetch pool; providers with a native async client override them.
+
+    async def agenerate_data_key(self, key_id):
+        return await _run_blocking(key_fetch_executor(), self.generate_data_key, key_id)
+
+    async def adecrypt_data_key(self, key_id, wrapped_key):
+        return await _run_blocking(
+            key_fetch_executor(), self.decrypt_data_key, key_id, wrapped_key
+        )
+
+
+# botocore error codes (or exception class names) worth another attempt.
+_THROTTLED = frozenset(
+    {
+        "RequestLimitExceeded",
+        "Throttling",
+        "ThrottlingException",
+        "TooManyRequestsException",
+    }
+)
+_TRANSIENT = _THROTTLED | {
+    "ConnectTimeoutError",
+    "ConnectionClosedError",
+    "DependencyTimeoutException",
+    "EndpointConnectionError",
+    "InternalFailure",
+    "KMSInternalException",
+    "ReadTimeoutError",
+    "ServiceUnavailable",
+}
+
+
+def _error_code(exc):
+    response = getattr(exc, "response", None)
+    if isinstance(response, dict):
+        code = response.get("Error", {}).get("Code")
+        if code:
+            return code
+    return type(exc).__name__
+
+
+def _transient(exc):
+    if isinstance(exc, (ConnectionError, TimeoutError)):
+        return True
+    return _error_code(exc) in _TRANSIENT
+
+
+class Backoff:
+    """Jittered exponential backoff that widens as throttling gets worse.
+
+    The throttle rate is an exponentially weighted share of recent key
+    service calls that were throttled.  Retry ``n`` waits a random time up
+    to ``base * 2**n``, stretched by ``1 + spread * rate`` and capped at
+    ``cap`` seconds.  While the rate is up, first attempts are spread out as
+    well, so a burst of new containers stops arriving in lockstep.
+    """
+
+    def __init__(self, attempts=5, base=0.05, cap=2.0, spread=4.0, smoothing=0.2):
+        self.attempts = attempts
+        self.base = base
+        self.cap = cap
+        self.spread = spread
+        self.smoothing = smoothing
+        self.throttle_rate = 0.0
+        self._lock = threading.Lock()
+
+    def record(self, throttled):
+        with self._lock:
+            self.throttle_rate += self.smoothing * (throttled - self.throttle_rate)
+
+    def delay(self, attempt):
+        """Seconds to wait before ``attempt``, 0 being the first try."""
+        rate = self.throttle_rate
+        if attempt:
+            ceiling = self.base * 2**attempt * (1 + self.spread * rate)
+        else:
+            ceiling = self.base * self.spread * rate
+        if ceiling <= 0:
+            return 0.0
+        import random
+
+        return random.uniform(0, min(ceiling, self.cap))
+
+
+def _replica_key_id(key_id, region):
+    # Aliases and mrk- key IDs resolve in every region; ARNs name theirs.
+    if not key_id.startswith("arn:"):
+        return key_id
+    parts = key_id.split(":")
+    parts[3] = region
+    return ":".join(parts)
+
+
+class KMSKeyProvider(KeyProvider):
+    """Data keys generated and unwrapped by AWS KMS.
+
+    ``async_client`` is an already-entered aioboto3/aiobotocore KMS client;
+    without one the async methods run the boto3 client on a worker thread.
+
+    Transient failures and throttling are retried by ``backoff``, a shared
+    :class:`Backoff`; the client built here leaves retries to it.  Once they
+    are exhausted, ``replicas`` -- region names, or a mapping of region
+    names to clients -- are tried in order with the same key ID, or the
+    ARN rewritten to that region: use it with multi-Region keys, whose
+    replicas unwrap each other's data keys.
+    """
+
+    def __init__(
+        self,
+        client=None,
+        region_name=None,
+        async_client=None,
+        backoff=None,
+        replicas=(),
+    ):
+        self._client = client
+        self._region_name = region_name
+        self._async_client = async_client
+        self.backoff = backoff or Backoff()
+        if not isinstance(replicas, dict):
+            replicas = dict.fromkeys(replicas)
+        self._replicas = dict(replicas)
+
+    @staticmethod
+    def _new_client(region_name):
+        import boto3
+        from botocore.config import Config
+
+        config = Config(retries={"total_max_attempts": 1})
+        return boto3.client("kms", region_name=region_name, config=config)
+
+    @property
+    def client(self):
+        if self._client is None:
+            self._client = self._new_client(self._region_name)
+        return self._client
+
+    def _replica(self, region):
+        client = self._replicas[region]
+        if client is None:
+            client = self._replicas[region] = self._new_client(region)
+        return client
+
+    def _retry(self, exc, attempt):
+        throttled = _error_code(exc) in _THROTTLED
+        self.backoff.record(throttled)
+        if throttled:
+            metrics.count("kms_throttles")
+        if attempt + 1 >= self.backoff.attempts or not _transient(exc):
+            return False
+        metrics.count("kms_retries")
+        return True
+
+    def _attempt(self, client, operation, params):
+        method = getattr(client, operation)
+        for attempt in range(self.backoff.attempts):
+            pause = self.backoff.delay(attempt)
+            if pause:
+                time.sleep(pause)
+            try:
+                response = method(**params)
+            except Exception as exc:
+                if not self._retry(exc, attempt):
+                    raise
+                continue
+            self.backoff.record(False)
+            return response
+
+    def _failover(self, operation, params, error):
+        if not self._replicas or not _transient(error):
+            raise error
+        for region in list(self._replicas):
+            metrics.count("kms_failovers")
+            replica = dict(params, KeyId=_replica_key_id(params["KeyId"], region))
+            try:
+                return self._attempt(self._replica(region), operation, replica)
+            except Exception as exc:
+                if not _transient(exc):
+                    raise
+        raise error
+
+    def _call(self, operation, **params):
+        try:
+            return self._attempt(self.client, operation, params)
+        except Exception as exc:
+            return self._failover(operation, params, exc)
+
+    async def _acall(self, operation, **params):
+        import asyncio
+
+        method = getattr(self._async_client, operation)
+        for attempt in range(self.backoff.attempts):
+            pause = self.backoff.delay(attempt)
+            if pause:
+                await asyncio.sleep(pause)
+            try:
+                response = await method(**params)
+            except Exception as exc:
+                if self._retry(exc, attempt):
+                    continue
+                return await _run_blocking(
+                    key_fetch_executor(), self._failover, operation, params, exc
+                )
+            self.backoff.record(False)
+            return response
+
+    def generate_data_key(self, key_id):
+        response = self._call("generate_data_key", KeyId=key_id, KeySpec="AES_256")
+        return bytearray(response["Plaintext"]), response["CiphertextBlob"]
+
+    def decrypt_data_key(self, key_id, wrapped_key):
+        response = self._call(
+            "decrypt", CiphertextBlob=bytes(wrapped_key), KeyId=key_id
+        )
+        return bytearray(response["Plaintext"])
+
+    def rewrap_data_key(self, key_id, wrapped_key, new_key_id):
+        # ReEncrypt never lets the plaintext key out of KMS.
+        response = self._attempt(
+            self.client,
+            "re_encrypt",
+            {
+                "CiphertextBlob": bytes(wrapped_key),
+                "SourceKeyId": key_id,
+                "DestinationKeyId": new_key_id,
+            },
+        )
+        return response["CiphertextBlob"]
+
+    async def agenerate_data_key(self, key_id):
+        if self._async_client is None:
+            return await super().agenerate_data_key(key_id)
+        response = await self._acall(
+            "generate_data_key", KeyId=key_id, KeySpec="AES_256"
+        )
+        return bytearray(response["Plaintext"]), response["CiphertextBlob"]
+
+    async def adecrypt_data_key(self, key_id, wrapped_key):
+        if self._async_client is None:
+            return await super().adecrypt_data_key(key_id, wrapped_key)
+        response = await self._acall(
+            "decrypt", CiphertextBlob=bytes(wrapped_key), KeyId=key_id
+        )
+        return bytearray(response["Plaintext"])
+
+
+class LocalKeyProvider(KeyProvider):
+    """Data keys wrapped under in-process master keys, for tests and local runs."""
+
+    def __init__(self, master_keys):
+        self._master_keys = {
+            key_id: bytearray(key) for key_id, key in master_keys.items()
+        }
+
+    def _master_key(self, key_id):
+        try:
+            return self._master_keys[key_id]
+        except KeyError:
+            raise CryptoError(f"unknown master key {key_id!r}") from None
+
+    def generate_data_key(self, key_id):
+        master_key = self._master_key(key_id)
+        data_key = bytearray(os.urandom(KEY_SIZE))
+        nonce = os.urandom(NONCE_SIZE)
+        sealed = aead_seal(master_key, nonce, data_key, key_id.encode())
+        return data_key, nonce + sealed
+
+    def decrypt_data_key(self, key_id, wrapped_key):
+        master_key = self._master_key(key_id)
+        wrapped_key = bytes(wrapped_key)
+        nonce, sealed = wrapped_key[:NONCE_SIZE], wrapped_key[NONCE_SIZE:]
+        return aead_open(master_key, nonce, sealed, key_id.encode())
+
+    def rewrap_data_key(self, key_id, wrapped_key, new_key_id):
+        master_key = self._master_key(new_key_id)
+        data_key = self.decrypt_data_key(key_id, wrapped_key)
+        nonce = os.urandom(NONCE_SIZE)
+        try:
+            return nonce + aead_seal(master_key, nonce, data_key, new_key_id.encode())
+        finally:
+            cleanUp.wipe(data_key)
+
+    # Unwrapping under a local key is cheaper than a thread hand-off.
+
+    async def agenerate_data_key(self, key_id):
+        return self.generate_data_key(key_id)
+
+    async def adecrypt_data_key(self, key_id, wrapped_key):
+        return self.decrypt_data_key(key_id, wrapped_key)
+
+
+class _CacheEntry:
+    __slots__ = ("nonce", "sealed", "wrapped_key", "expires_at", "uses")
+
+    def __init__(self, nonce, sealed, wrapped_key, expires_at):
+        self.nonce = nonce
+        self.sealed = sealed
+        self.wrapped_key = wrapped_key
+        self.expires_at = expires_at
+        self.uses = 0
+
+
+class DataKeyCache:
+    """Per-container cache of unwrapped data keys.
+
+    Lives for as long as the function instance, so it survives across warm
+    invocations.  Entries are sealed under a random in-process key rather
+    than kept as plaintext, expire after ``ttl`` seconds, and encryption keys
+    are retired after ``max_messages`` uses.  Expiry uses the wall clock:
+    a frozen Lambda sandbox must not extend a key's lifetime.
+    """
+
+    def __init__(self, ttl=300.0, max_entries=256, max_messages=2**20):
+        self.ttl = ttl
+        self.max_entries = max_entries
+        self.max_messages = max_messages
+        self._lock = threading.Lock()
+        self._cipher = None
+        self._decrypt_entries = {}
+        self._encrypt_entries = {}
+        self._purged_at = None
+        _caches.add(self)
+
+    def __len__(self):
+        with self._lock:
+            return len(self._decrypt_entries)
+
+    def _cache_cipher(self):
+        # Keyed once per cache key, so sealing an entry only sets a nonce.
+        if self._cipher is None:
+            cache_key = bytearray(os.urandom(KEY_SIZE))
+            try:
+                self._cipher = backends.cipher(backends.default_algorithm(), cache_key)
+            finally:
+                cleanUp.wipe(cache_key)
+        return self._cipher
+
+    def _seal(self, plaintext, wrapped_key):
+        nonce = os.urandom(NONCE_SIZE)
+        sealed = bytearray(self._cache_cipher().seal(nonce, plaintext))
+        return _CacheEntry(nonce, sealed, wrapped_key, time.time() + self.ttl)
+
+    def _unseal(self, entry):
+        cipher = self._cache_cipher()
+        return _open_with(cipher, entry.nonce, entry.sealed, b"", bytearray)
+
+    def _drop(self, key):
+        entry = self._decrypt_entries.pop(key)
+        if self._encrypt_entries.get(key[0]) is entry:
+            del self._encrypt_entries[key[0]]
+        cleanUp.wipe(entry.sealed)
+
+    def get(self, key_id, wrapped_key):
+        """Return the unwrapped data key for ``wrapped_key``, or ``None``."""
+        key = (key_id, bytes(wrapped_key))
+        with self._lock:
+            entry = self._decrypt_entries.get(key)
+            if entry is None:
+                return None
+            if entry.expires_at <= time.time():
+                self._drop(key)
+                return None
+            return self._unseal(entry)
+
+    def put(self, key_id, wrapped_key, plaintext):
+        key = (key_id, bytes(wrapped_key))
+        with self._lock:
+            if key in self._decrypt_entries:
+                return
+            if len(self._decrypt_entries) >= self.max_entries:
+                entries = self._decrypt_entries
+                self._drop(min(entries, key=lambda k: entries[k].expires_at))
+            self._decrypt_entries[key] = self._seal(plaintext, key[1])
+
+    def get_encryption_key(self, key_id, messages=1):
+        """Return ``(plaintext_key, wrapped_key)`` to encrypt under, or ``None``.
+
+        ``messages`` is how many messages the caller will seal with it.
+        """
+        with self._lock:
+            entry = self._encrypt_entries.get(key_id)
+            if entry is None:
+                return None
+            if entry.expires_at <= time.time():
+                self._drop((key_id, entry.wrapped_key))
+                return None
+            if entry.uses >= self.max_messages:
+                # Retired for encryption; it still opens what it sealed.
+                del self._encrypt_entries[key_id]
+                return None
+            entry.uses += messages
+            return self._unseal(entry), entry.wrapped_key
+
+    def put_encryption_key(self, key_id, plaintext, wrapped_key, messages=1):
+        key = (key_id, bytes(wrapped_key))
+        self.put(key_id, wrapped_key, plaintext)
+        with self._lock:
+            entry = self._decrypt_entries.get(key)
+            if entry is not None:
+                entry.uses = messages
+                self._encrypt_entries[key_id] = entry
+
+    def retire(self, key_id):
+        """Stop encrypting under the cached key for ``key_id``; it still decrypts."""
+        with self._lock:
+            self._encrypt_entries.pop(key_id, None)
+
+    def purge_expired(self):
+        """Drop expired entries; returns how many were removed."""
+        now = time.time()
+        with self._lock:
+            entries = self._decrypt_entries
+            expired = [key for key, entry in entries.items() if entry.expires_at <= now]
+            for key in expired:
+                self._drop(key)
+            self._purged_at = now
+            return len(expired)
+
+    def residue(self):
+        """Sealed keys that had expired by the last :meth:`purge_expired`.
+
+        Such an entry should have been wiped and dropped, so each one
+        fails :func:`SDS.cleanUp.verify_wiped`.
+        """
+        with self._lock:
+            purged_at = self._purged_at
+            if purged_at is None:
+                return []
+            entries = self._decrypt_entries.values()
+            return [entry.sealed for entry in entries if entry.expires_at <= purged_at]
+
+    def clear(self):
+        """Wipe every entry and rotate the in-process cache key."""
+        with self._lock:
+            for entry in self._decrypt_entries.values():
+                cleanUp.wipe(entry.sealed)
+            self._decrypt_entries.clear()
+            self._encrypt_entries.clear()
+            if self._cipher is not None:
+                self._cipher.close()
+                self._cipher = None
+
+
+def _default_ttl():
+    return float(os.environ.get("SDS_KEY_CACHE_TTL", "300"))
+
+
+# Every cache, not only key_cache, is emptied before a snapshot.
+_caches = weakref.WeakSet()
+
+
+@cleanUp.register_snapshot_hook
+def _clear_caches():
+    for cache in list(_caches):
+        cache.clear()
+
+
+key_cache = DataKeyCache(ttl=_default_ttl())
+cleanUp.register_invocation_hook(key_cache.purge_expired)
+cleanUp.register_shutdown_hook(key_cache.clear)
+cleanUp.register_wipe_check(key_cache.residue)
+
+
+@cleanUp.register_restore_hook
+def _reseed():
+    # os.urandom reads the kernel pool, which a restore reseeds; the random
+    # module behind Backoff's jitter would repeat in every restored clone.
+    random = sys.modules.get("random")
+    if random is not None:
+        random.seed()
+
+
+_default_provider = None
+_executors = {}
+_executor_lock = threading.Lock()
+
+# Below this many bytes, AEAD work is cheaper than a thread hand-off.
+OFFLOAD_THRESHOLD = 16 * 1024
+
+
+def get_key_provider():
+    global _default_provider
+    if _default_provider is None:
+        _default_provider = KMSKeyProvider()
+    return _default_provider
+
+
+def set_key_provider(provider):
+    global _default_provider
+    _default_provider = provider
+
+
+def _shared_executor(name, max_workers):
+    with _executor_lock:
+        executor = _executors.get(name)
+        if executor is None:
+            import concurrent.futures
+
+            executor = concurrent.futures.ThreadPoolExecutor(
+                max_workers=max_workers, thread_name_prefix=f"sds-{name}"
+            )
+            _executors[name] = executor
+        return executor
+
+
+def key_fetch_executor():
+    """Shared pool for overlapping key-service round-trips."""
+    workers = int(os.environ.get("SDS_KEY_FETCH_WORKERS", "16"))
+    return _shared_executor("key-fetch", workers)
+
+
+def crypto_executor():
+    """Shared pool that keeps CPU-bound AEAD work off the event loop."""
+    return _shared_executor("crypto", os.cpu_count() or 1)
+
+
+async def _run_blocking(executor, fn, *args):
+    import asyncio
+
+    loop = asyncio.get_running_loop()
+    return await loop.run_in_executor(executor, functools.partial(fn, *args))
+
+
+async def _offload(size, fn, *args):
+    if size < OFFLOAD_THRESHOLD:
+        return fn(*args)
+    return await _run_blocking(crypto_executor(), fn, *args)
+
+
+def _message_key(data_key, salt, key_id):
+    return hkdf(data_key, salt, b"SDS-v1|" + key_id.encode())
+
+
+def _cache_lookup(cache, key_id, wrapped_key):
+    if cache is None:
+        return None
+    with metrics.timer("unwrap"):
+        data_key = cache.get(key_id, wrapped_key)
+    metrics.count("key_cache_misses" if data_key is None else "key_cache_hits")
+    return data_key
+
+
+class _Flight:
+    """A key fetch in progress, which concurrent callers wait for."""
+
+    __slots__ = ("done", "data_key", "error", "waiters", "wakeups", "loop_thread")
+
+    def __init__(self, loop_thread=None):
+        self.done = threading.Event()
+        self.data_key = None
+        self.error = None
+        self.waiters = 0
+        self.wakeups = []
+        self.loop_thread = loop_thread
+
+
+_flights = {}
+_flights_lock = threading.Lock()
+
+# How long a blocking caller waits for another's fetch before making its own.
+FLIGHT_TIMEOUT = 10.0
+_STRANDED = object()
+
+
+def _join_flight(key, blocking=True):
+    """Return ``(flight, leader)``; only the leader calls the key service.
+
+    A flight led by a coroutine lands only once its event loop runs again,
+    so a blocking caller on that loop's thread would wait forever: it gets
+    ``(None, True)`` and fetches on its own.
+    """
+    thread = threading.get_ident()
+    with _flights_lock:
+        flight = _flights.get(key)
+        if flight is None:
+            flight = _flights[key] = _Flight(None if blocking else thread)
+            return flight, True
+        if blocking and flight.loop_thread == thread:
+            return None, True
+        flight.waiters += 1
+    metrics.count("key_fetches_coalesced")
+    return flight, False
+
+
+def _land(key, flight, data_key=None, error=None):
+    if flight is None:
+        return
+    with _flights_lock:
+        del _flights[key]
+        if flight.waiters and data_key is not None:
+            # Every caller wipes its key, so each waiter gets its own copy.
+            flight.data_key = bytearray(data_key)
+        flight.error = error
+        flight.done.set()
+        wakeups = flight.wakeups
+    for loop, future in wakeups:
+        loop.call_soon_threadsafe(_wake, future)
+
+
+def _wake(future):
+    if not future.done():
+        future.set_result(None)
+
+
+def _flight_result(flight):
+    with _flights_lock:
+        flight.waiters -= 1
+        if flight.error is not None:
+            raise flight.error
+        if flight.data_key is None:
+            return None
+        data_key = bytearray(flight.data_key)
+        if not flight.waiters:
+            cleanUp.wipe(flight.data_key)
+        return data_key
+
+
+def _wait_flight(flight):
+    """The flight's result, or ``_STRANDED`` after :data:`FLIGHT_TIMEOUT`."""
+    if not flight.done.wait(FLIGHT_TIMEOUT):
+        with _flights_lock:
+            if not flight.done.is_set():
+                flight.waiters -= 1
+                metrics.count("key_fetch_waits_timed_out")
+                return _STRANDED
+    return _flight_result(flight)
+
+
+async def _await_flight(flight):
+    import asyncio
+
+    future = asyncio.get_running_loop().create_future()
+    with _flights_lock:
+        if flight.done.is_set():
+            future.set_result(None)
+        else:
+            flight.wakeups.append((future.get_loop(), future))
+    await future
+    return _flight_result(flight)
+
+
+# Concurrent cache misses for one key share a single key service call: the
+# first caller leads the fetch, the others wait for it to land.  Waiters for
+# a new encryption key then read it from the cache the leader filled.  A
+# new leader looks at the cache once more, as a flight may have landed
+# between its miss and taking the lead.
+
+
+def _encryption_key(key_id, provider, cache, messages=1):
+    if cache is None:
+        with metrics.timer("key_fetch"):
+            data_key, wrapped_key = provider.generate_data_key(key_id)
+        metrics.count("key_fetches")
+        return data_key, bytes(wrapped_key)
+    key = ("generate", provider, key_id)
+    while True:
+        cached = cache.get_encryption_key(key_id, messages)
+        if cached is not None:
+            return cached
+        flight, leader = _join_flight(key)
+        if leader:
+            break
+        if _wait_flight(flight) is _STRANDED:
+            flight = None
+            break
+    cached = cache.get_encryption_key(key_id, messages)
+    if cached is not None:
+        _land(key, flight)
+        return cached
+    try:
+        with metrics.timer("key_fetch"):
+            data_key, wrapped_key = provider.generate_data_key(key_id)
+        metrics.count("key_fetches")
+        cache.put_encryption_key(key_id, data_key, wrapped_key, messages)
+    except BaseException as exc:
+        _land(key, flight, error=exc)
+        raise
+    _land(key, flight)
+    return data_key, bytes(wrapped_key)
+
+
+async def _aencryption_key(key_id, provider, cache):
+    if cache is None:
+        with metrics.timer("key_fetch"):
+            data_key, wrapped_key = await provider.agenerate_data_key(key_id)
+        metrics.count("key_fetches")
+        return data_key, bytes(wrapped_key)
+    key = ("generate", provider, key_id)
+    while True:
+        cached = cache.get_encryption_key(key_id)
+        if cached is not None:
+            return cached
+        flight, leader = _join_flight(key, blocking=False)
+        if leader:
+            break
+        await _await_flight(flight)
+    cached = cache.get_encryption_key(key_id)
+    if cached is not None:
+        _land(key, flight)
+        return cached
+    try:
+        with metrics.timer("key_fetch"):
+            data_key, wrapped_key = await provider.agenerate_data_key(key_id)
+        metrics.count("key_fetches")
+        cache.put_encryption_key(key_id, data_key, wrapped_key)
+    except BaseException as exc:
+        _land(key, flight, error=exc)
+        raise
+    _land(key, flight)
+    return data_key, bytes(wrapped_key)
+
+
+def unwrap_data_key(key_id, wrapped_key, provider=None, cache=key_cache):
+    """Unwrap a data key, going to the key provider only on a cache miss."""
+    data_key = _cache_lookup(cache, key_id, wrapped_key)
+    if data_key is not None:
+        return data_key
+    provider = provider or get_key_provider()
+    key = ("decrypt", provider, key_id, bytes(wrapped_key))
+    flight, leader = _join_flight(key)
+    if not leader:
+        data_key = _wait_flight(flight)
+        if data_key is not _STRANDED:
+            return data_key
+        flight = None
+    elif cache is not None:
+        data_key = cache.get(key_id, wrapped_key)
+        if data_key is not None:
+            _land(key, flight, data_key)
+            return data_key
+    try:
+        with metrics.timer("key_fetch"):
+            data_key = provider.decrypt_data_key(key_id, wrapped_key)
+        metrics.count("key_fetches")
+        if cache is not None:
+            cache.put(key_id, wrapped_key, data_key)
+    except BaseException as exc:
+        _land(key, flight, error=exc)
+        raise
+    _land(key, flight, data_key)
+    return data_key
+
+
+async def aunwrap_data_key(key_id, wrapped_key, provider=None, cache=key_cache):
+    """Async :func:`unwrap_data_key`; the key service is awaited, not blocked on."""
+    data_key = _cache_lookup(cache, key_id, wrapped_key)
+    if data_key is not None:
+        return data_key
+    provider = provider or get_key_provider()
+    key = ("decrypt", provider, key_id, bytes(wrapped_key))
+    flight, leader = _join_flight(key, blocking=False)
+    if not leader:
+        return await _await_flight(flight)
+    if cache is not None:
+        data_key = cache.get(key_id, wrapped_key)
+        if data_key is not None:
+            _land(key, flight, data_key)
+            return data_key
+    try:
+        with metrics.timer("key_fetch"):
+            data_key = await provider.adecrypt_data_key(key_id, wrapped_key)
+        metrics.count("key_fetches")
+        if cache is not None:
+            cache.put(key_id, wrapped_key, data_key)
+    except BaseException as exc:
+        _land(key, flight, error=exc)
+        raise
+    _land(key, flight, data_key)
+    return data_key
+
+
+class _ZlibCodec:
+    name = "zlib"
+    ident = 1
+
+    def compress(self, data, level):
+        return zlib.compress(data, -1 if level is None else level)
+
+    def decompress(self, data):
+        return zlib.decompress(data)
+
+    def compressobj(self, level):
+        return zlib.compressobj(-1 if level is None else level)
+
+    def decompressobj(self):
+        return zlib.decompressobj()
+
+
+class _ZstdCodec:
+    name = "zstd"
+    ident = 2
+
+    @staticmethod
+    def _module():
+        import zstandard
+
+        return zstandard
+
+    def compress(self, data, level):
+        return self._module().ZstdCompressor(level=level or 3).compress(data)
+
+    def decompress(self, data):
+        return self._module().ZstdDecompressor().decompress(data)
+
+    def compressobj(self, level):
+        return self._module().ZstdCompressor(level=level or 3).compressobj()
+
+    def decompressobj(self):
+        return _ZstdDecompressor(self._module().ZstdDecompressor().decompressobj())
+
+
+class _LZ4Compressor:
+    # lz4's frame compressor wants begin() first; give it zlib's shape.
+
+    def __init__(self, compressor):
+        self._compressor = compressor
+        self._started = False
+
+    def _begin(self):
+        if self._started:
+            return b""
+        self._started = True
+        return self._compressor.begin()
+
+    def compress(self, data):
+        return self._begin() + self._compressor.compress(data)
+
+    def flush(self):
+        return self._begin() + self._compressor.flush()
+
+
+class _ZstdDecompressor:
+    # zstandard cannot bound its output, so zlib's max_length is cut here.
+
+    unconsumed_tail = b""
+
+    def __init__(self, decompressor):
+        self._decompressor = decompressor
+        self._ready = b""
+
+    def decompress(self, data, max_length):
+        if data:
+            self._ready += self._decompressor.decompress(data)
+        piece, self._ready = self._ready[:max_length], self._ready[max_length:]
+        return piece
+
+    @property
+    def eof(self):
+        return self._decompressor.eof and not self._ready
+
+
+class _LZ4Decompressor:
+    # lz4 keeps input it has not read yet itself; give it zlib's shape too.
+
+    unconsumed_tail = b""
+
+    def __init__(self, decompressor):
+        self._decompressor = decompressor
+
+    def decompress(self, data, max_length):
+        return self._decompressor.decompress(data, max_length)
+
+    @property
+    def eof(self):
+        return self._decompressor.eof
+
+
+class _LZ4Codec:
+    name = "lz4"
+    ident = 3
+
+    @staticmethod
+    def _module():
+        import lz4.frame
+
+        return lz4.frame
+
+    def compress(self, data, level):
+        return self._module().compress(data, compression_level=level or 0)
+
+    def decompress(self, data):
+        return self._module().decompress(data)
+
+    def compressobj(self, level):
+        frame = self._module()
+        return _LZ4Compressor(frame.LZ4FrameCompressor(compression_level=level or 0))
+
+    def decompressobj(self):
+        return _LZ4Decompressor(self._module().LZ4FrameDecompressor())
+
+
+_CODECS = {codec.name: codec for codec in (_ZlibCodec(), _ZstdCodec(), _LZ4Codec())}
+_CODECS_BY_ID = {codec.ident: codec for codec in _CODECS.values()}
+# The codec id shares the algorithm byte of envelope and stream headers.
+_CODEC_SHIFT = 4
+# Uncompressed length, sealed in front of the compressed plaintext.
+_PACKED_SIZE = struct.Struct(">L")
+
+
+def available_codecs():
+    """Names of the compression codecs importable here, fastest first."""
+    found = []
+    for name, module in (("zstd", "zstandard"), ("lz4", "lz4.frame")):
+        try:
+            __import__(module)
+        except ImportError:
+            continue
+        found.append(name)
+    return found + ["zlib"]
+
+
+def _entropy(sample):
+    # Shannon entropy in bits per byte: ~8 for random or already compressed
+    # data, well under 6 for JSON and log text.
+    total = len(sample)
+    counts = collections.Counter(sample).values()
+    return -sum(count / total * math.log2(count / total) for count in counts)
+
+
+class Compression:
+    """Opt-in compression of plaintexts before they are sealed.
+
+    Plaintexts shorter than ``min_size`` bytes, or whose first
+    ``sample_size`` bytes look incompressible (Shannon entropy above
+    ``max_entropy`` bits per byte), are sealed as they are; so is anything
+    that does not shrink.  ``codec`` defaults to the first of
+    :func:`available_codecs`.  The choice is recorded in the envelope or
+    stream header, so readers need no configuration.
+
+    Off unless passed explicitly, field by field: once a plaintext is
+    compressed its ciphertext length says how well it compressed, which
+    leaks secrets stored next to attacker-chosen data (CRIME, BREACH).
+    The compressed and decompressed copies are ordinary ``bytes`` and
+    cannot be wiped.
+    """
+
+    def __init__(
+        self, codec=None, min_size=1024, max_entropy=7.0, sample_size=4096, level=None
+    ):
+        codec = codec or available_codecs()[0]
+        if codec not in _CODECS:
+            raise ValueError(f"unknown compression codec {codec!r}")
+        self.codec = codec
+        self.min_size = min_size
+        self.max_entropy = max_entropy
+        self.sample_size = sample_size
+        self.level = level
+
+    def worthwhile(self, plaintext):
+        """Whether ``plaintext`` passes the size and entropy checks."""
+        if len(plaintext) < self.min_size:
+            return False
+        sample = memoryview(plaintext).cast("B")[: self.sample_size]
+        return _entropy(sample) <= self.max_entropy
+
+    def pack(self, plaintext):
+        """Return ``(codec, packed)`` to seal, or ``(None, plaintext)``."""
+        if not self.worthwhile(plaintext):
+            return None, plaintext
+        with metrics.timer("compress"):
+            compressed = _CODECS[self.codec].compress(plaintext, self.level)
+        if len(compressed) + _PACKED_SIZE.size >= len(plaintext):
+            return None, plaintext
+        packed = bytearray(_PACKED_SIZE.pack(len(plaintext)))
+        packed += compressed
+        metrics.count("compression_saved_bytes", len(plaintext) - len(packed))
+        return self.codec, packed
+
+
+def _pack(compress, plaintext):
+    if compress is None:
+        return None, plaintext
+    return compress.pack(plaintext)
+
+
+def _inflate(codec, packed, alloc):
+    # Decompress a plaintext sealed by Compression.pack into alloc(size).
+    if len(packed) < _PACKED_SIZE.size:
+        raise DecryptionError("compressed payload is truncated")
+    (size,) = _PACKED_SIZE.unpack_from(packed)
+    try:
+        with metrics.timer("decompress"):
+            data = _CODECS[codec].decompress(memoryview(packed)[_PACKED_SIZE.size :])
+    except Exception as exc:
+        raise DecryptionError(f"corrupt compressed payload: {exc}") from None
+    if len(data) != size:
+        raise DecryptionError("compressed payload does not match its size")
+    out = alloc(size)
+    _writable(out)[:] = data
+    return out
+
+
+def _open_payload(cipher, nonce, sealed, aad, alloc, codec):
+    if codec is None:
+        return _open_with(cipher, nonce, sealed, aad, alloc)
+    packed = _open_with(cipher, nonce, sealed, aad, bytearray)
+    try:
+        return _inflate(codec, packed, alloc)
+    finally:
+        cleanUp.wipe(packed)
+
+
+def _algorithm_byte(algorithm, codec):
+    codec_id = _CODECS[codec].ident if codec else 0
+    return _ALGORITHM_IDS[algorithm] | codec_id << _CODEC_SHIFT
+
+
+def _split_algorithm_byte(value):
+    """Return ``(algorithm, codec)``; either is ``None`` when unknown."""
+    algorithm = _ALGORITHMS.get(value & ((1 << _CODEC_SHIFT) - 1))
+    codec_id = value >> _CODEC_SHIFT
+    if not codec_id:
+        return algorithm, None
+    codec = _CODECS_BY_ID.get(codec_id)
+    return (algorithm, codec.name) if codec else (None, None)
+
+
+def _envelope_head(algorithm, key_id, wrapped_key, salt, codec=None):
+    # Every field but the per-message ones, which _envelope appends.
+    kid = key_id.encode()
+    key_version, wrapped_key = _split_key_version(bytes(wrapped_key))
+    if len(kid) > 0xFFFF or len(wrapped_key) > 0xFFFF:
+        raise CryptoError("key ID or wrapped key is too long for an envelope")
+    fixed = _ENVELOPE_FIXED.pack(
+        ENVELOPE_VERSION,
+        _algorithm_byte(algorithm, codec),
+        key_version,
+        len(kid),
+        len(wrapped_key),
+    )
+    return b"".join((fixed, kid, wrapped_key, salt))
+
+
+def _envelope(head, nonce, sealed):
+    return b"".join((head, nonce, sealed))
+
+
+def _key_version(wrapped_key):
+    # The version byte of a keyring header, None for a bare wrapped key.
+    if bytes(wrapped_key[: len(KEYRING_MAGIC)]) != KEYRING_MAGIC:
+        return None
+    if len(wrapped_key) < _KEYRING_HEADER_SIZE:
+        raise CryptoError("wrapped key has a truncated keyring header")
+    return wrapped_key[len(KEYRING_MAGIC)]
+
+
+def _split_key_version(wrapped_key):
+    # A keyring's header travels as the envelope's key version byte.
+    version = _key_version(wrapped_key)
+    if version is None:
+        return 0, wrapped_key
+    return version, wrapped_key[_KEYRING_HEADER_SIZE:]
+
+
+def to_text(envelope):
+    """Text-safe form of a binary envelope, for environment variables and JSON.
+
+    Unpadded URL-safe base64; :func:`parse_envelope` reads it back.
+    """
+    return base64.urlsafe_b64encode(envelope).rstrip(b"=").decode("ascii")
+
+
+def _from_text(text):
+    padded = text + "=" * (-len(text) % 4)
+    return base64.b64decode(padded, altchars=b"-_", validate=True)
+
+
+def _seal_envelope(plaintext, key_id, data_key, wrapped_key, compress=None):
+    algorithm = backends.default_algorithm()
+    salt = os.urandom(SALT_SIZE)
+    nonce = os.urandom(NONCE_SIZE)
+    message_key = _message_key(data_key, salt, key_id)
+    try:
+        codec, payload = _pack(compress, plaintext)
+        sealed = aead_seal(message_key, nonce, payload, key_id.encode(), algorithm)
+    finally:
+        cleanUp.wipe(message_key)
+        cleanUp.wipe(data_key)
+    if codec is not None:
+        cleanUp.wipe(payload)
+    head = _envelope_head(algorithm, key_id, wrapped_key, salt, codec)
+    return _envelope(head, nonce, sealed)
+
+
+def encrypt(
+    plaintext, key_id, provider=None, cache=key_cache, text=False, compress=None
+):
+    """Seal ``plaintext`` under master key ``key_id`` into a binary envelope.
+
+    With ``text`` the envelope comes back in its :func:`to_text` form;
+    ``compress`` is a :class:`Compression` to apply first.
+    """
+    provider = provider or get_key_provider()
+    data_key, wrapped_key = _encryption_key(key_id, provider, cache)
+    envelope = _seal_envelope(plaintext, key_id, data_key, wrapped_key, compress)
+    return to_text(envelope) if text else envelope
+
+
+async def aencrypt(
+    plaintext, key_id, provider=None, cache=key_cache, text=False, compress=None
+):
+    """Async :func:`encrypt`: awaits the key service, offloads large AEAD work."""
+    provider = provider or get_key_provider()
+    data_key, wrapped_key = await _aencryption_key(key_id, provider, cache)
+    envelope = await _offload(
+        len(plaintext),
+        _seal_envelope,
+        plaintext,
+        key_id,
+        data_key,
+        wrapped_key,
+        compress,
+    )
+    return to_text(envelope) if text else envelope
+
+
+def parse_envelope(envelope):
+    """Split an envelope into its fields without copying the ciphertext.
+
+    ``envelope`` is a binary envelope or any buffer holding one -- a
+    ``memoryview`` into a larger record is read in place -- its
+    :func:`to_text` form, or a JSON envelope from before version 2.  For
+    binary input ``nonce`` and ``ct`` are ``memoryview`` slices of it.
+    """
+    if isinstance(envelope, str):
+        if envelope.startswith("{"):
+            return _parse_json_envelope(envelope)
+        try:
+            envelope = _from_text(envelope)
+        except ValueError as exc:
+            raise DecryptionError(f"malformed envelope: {exc}") from None
+    view = memoryview(envelope)
+    if view[:1] == b"{":
+        return _parse_json_envelope(bytes(view))
+    try:
+        version, algorithm_id, key_version, kid_size, key_size = (
+            _ENVELOPE_FIXED.unpack_from(view)
+        )
+    except struct.error:
+        raise DecryptionError("malformed envelope: truncated header") from None
+    algorithm, codec = _split_algorithm_byte(algorithm_id)
+    if version != ENVELOPE_VERSION or algorithm is None:
+        raise DecryptionError(f"unsupported envelope {version!r}/{algorithm_id!r}")
+    kid_start = _ENVELOPE_FIXED.size
+    key_start = kid_start + kid_size
+    salt_start = key_start + key_size
+    nonce_start = salt_start + SALT_SIZE
+    ct_start = nonce_start + NONCE_SIZE
+    if len(view) < ct_start:
+        raise DecryptionError("malformed envelope: truncated")
+    wrapped_key = bytes(view[key_start:salt_start])
+    if key_version:
+        wrapped_key = KEYRING_MAGIC + bytes((key_version,)) + wrapped_key
+    try:
+        key_id = str(view[kid_start:key_start], "utf-8")
+    except UnicodeDecodeError as exc:
+        raise DecryptionError(f"malformed envelope: {exc}") from None
+    return {
+        "alg": algorithm,
+        "codec": codec,
+        "kid": key_id,
+        "key": wrapped_key,
+        "salt": bytes(view[salt_start:nonce_start]),
+        "nonce": view[nonce_start:ct_start],
+        "ct": view[ct_start:],
+    }
+
+
+def _parse_json_envelope(envelope):
+    try:
+        fields = json.loads(envelope)
+        if fields["v"] != 1 or fields["alg"] not in backends.ALGORITHMS:
+            raise DecryptionError(
+                f"unsupported envelope {fields['v']!r}/{fields['alg']!r}"
+            )
+        return {
+            "alg": fields["alg"],
+            "codec": None,
+            "kid": fields["kid"],
+            "key": base64.b64decode(fields["key"]),
+            "salt": base64.b64decode(fields["salt"]),
+            "nonce": base64.b64decode(fields["nonce"]),
+            "ct": base64.b64decode(fields["ct"]),
+        }
+    except (ValueError, KeyError, TypeError) as exc:
+        raise DecryptionError(f"malformed envelope: {exc}") from None
+
+
+def _open(fields, data_key, alloc):
+    key_id = fields["kid"]
+    with metrics.timer("unwrap"):
+        message_key = _message_key(data_key, fields["salt"], key_id)
+    try:
+        cipher = backends.cipher(fields["alg"], message_key)
+    finally:
+        cleanUp.wipe(message_key)
+    nonce, sealed, codec = fields["nonce"], fields["ct"], fields["codec"]
+    try:
+        with metrics.timer("decrypt"):
+            return _open_payload(cipher, nonce, sealed, key_id.encode(), alloc, codec)
+    finally:
+        cipher.close()
+
+
+def decrypt(envelope, provider=None, cache=key_cache, alloc=bytearray):
+    """Open an envelope produced by :func:`encrypt`, in either form.
+
+    The plaintext lands in ``alloc(size)``; see :func:`aead_open`.
+    """
+    fields = parse_envelope(envelope)
+    data_key = unwrap_data_key(fields["kid"], fields["key"], provider, cache)
+    try:
+        return _open(fields, data_key, alloc)
+    finally:
+        cleanUp.wipe(data_key)
+
+
+async def adecrypt(envelope, provider=None, cache=key_cache, alloc=bytearray):
+    """Async :func:`decrypt`."""
+    fields = parse_envelope(envelope)
+    data_key = await aunwrap_data_key(fields["kid"], fields["key"], provider, cache)
+    try:
+        return await _offload(len(fields["ct"]), _open, fields, data_key, alloc)
+    finally:
+        cleanUp.wipe(data_key)
+
+
+KEYRING_MAGIC = b"SDSK"
+_KEYRING_HEADER_SIZE = len(KEYRING_MAGIC) + 1
+
+
+class Keyring(KeyProvider):
+    """Versioned master keys behind one logical key ID.
+
+    Envelopes keep naming ``key_id``, but their data keys are wrapped under
+    ``versions[n]`` and carry a header -- :data:`KEYRING_MAGIC` and a version
+    byte -- saying which.  New data keys use the current (highest) version;
+    older versions stay decrypt-only, so rotating never re-encrypts data
+    and never blocks a read.  Data keys wrapped before the keyring existed
+    have no header and are unwrapped under ``legacy``, ``key_id`` itself by
+    default.  Key IDs other than ``key_id`` go straight to ``provider``::
+
+        keyring = Keyring("alias/app", {1: old_key_arn, 2: new_key_arn}, kms)
+        set_key_provider(keyring)
+
+    :meth:`rewrap` and :meth:`rewrap_later` then move stored envelopes to
+    the current version one data key at a time; envelopes sharing a data
+    key cost a single provider call between them.
+    """
+
+    def __init__(self, key_id, versions, provider=None, legacy=None, memo_size=1024):
+        # Version 0 is how envelopes mark a data key without a keyring.
+        if not versions or not all(0 < version < 256 for version in versions):
+            raise ValueError("key versions must be integers in range(1, 256)")
+        self.key_id = key_id
+        self.legacy = legacy or key_id
+        self.memo_size = memo_size
+        self._provider = provider
+        self._lock = threading.Lock()
+        # Replaced wholesale by rotate(), so readers never take the lock.
+        self._versions = dict(versions)
+        self._current = max(versions)
+        self._rewrapped = collections.OrderedDict()
+
+    @property
+    def provider(self):
+        return self._provider or get_key_provider()
+
+    @property
+    def current(self):
+        return self._current
+
+    @property
+    def versions(self):
+        return dict(self._versions)
+
+    def rotate(self, master_key_id, cache=key_cache):
+        """Make ``master_key_id`` the current version; returns its number."""
+        with self._lock:
+            version = self._current + 1
+            if version > 255:
+                raise CryptoError("keyring is out of key versions")
+            self._versions = {**self._versions, version: master_key_id}
+            self._current = version
+        if cache is not None:
+            cache.retire(self.key_id)
+        return version
+
+    def version(self, wrapped_key):
+        """The key version ``wrapped_key`` is under, ``None`` when legacy."""
+        return _key_version(wrapped_key)
+
+    def _master_key_id(self, wrapped_key):
+        version = self.version(wrapped_key)
+        if version is None:
+            return self.legacy, wrapped_key
+        try:
+            master_key_id = self._versions[version]
+        except KeyError:
+            raise CryptoError(f"unknown key version {version}") from None
+        return master_key_id, wrapped_key[_KEYRING_HEADER_SIZE:]
+
+    def _header(self, version):
+        return KEYRING_MAGIC + bytes((version,))
+
+    def generate_data_key(self, key_id):
+        if key_id != self.key_id:
+            return self.provider.generate_data_key(key_id)
+        version = self._current
+        data_key, wrapped_key = self.provider.generate_data_key(self._versions[version])
+        return data_key, self._header(version) + bytes(wrapped_key)
+
+    def decrypt_data_key(self, key_id, wrapped_key):
+        if key_id != self.key_id:
+            return self.provider.decrypt_data_key(key_id, wrapped_key)
+        return self.provider.decrypt_data_key(*self._master_key_id(wrapped_key))
+
+    async def agenerate_data_key(self, key_id):
+        if key_id != self.key_id:
+            return await self.provider.agenerate_data_key(key_id)
+        version = self._current
+        master_key_id = self._versions[version]
+        data_key, wrapped_key = await self.provider.agenerate_data_key(master_key_id)
+        return data_key, self._header(version) + bytes(wrapped_key)
+
+    async def adecrypt_data_key(self, key_id, wrapped_key):
+        if key_id != self.key_id:
+            return await self.provider.adecrypt_data_key(key_id, wrapped_key)
+        return await self.provider.adecrypt_data_key(*self._master_key_id(wrapped_key))
+
+    def stale(self, wrapped_key):
+        """Whether ``wrapped_key`` is under an older version than the current."""
+        return self.version(wrapped_key) != self._current
+
+    def rewrap_data_key(self, key_id, wrapped_key, new_key_id=None):
+        """Move ``wrapped_key`` to the current version; unchanged if already there."""
+        if key_id != self.key_id:
+            return self.provider.rewrap_data_key(key_id, wrapped_key, new_key_id)
+        wrapped_key = bytes(wrapped_key)
+        version = self._current
+        if self.version(wrapped_key) == version:
+            return wrapped_key
+        with self._lock:
+            rewrapped = self._rewrapped.get(wrapped_key)
+        if rewrapped is not None and self.version(rewrapped) == version:
+            return rewrapped
+        master_key_id, inner = self._master_key_id(wrapped_key)
+        with metrics.timer("key_fetch"):
+            rewrapped = self.provider.rewrap_data_key(
+                master_key_id, inner, self._versions[version]
+            )
+        metrics.count("key_rewraps")
+        rewrapped = self._header(version) + bytes(rewrapped)
+        with self._lock:
+            self._rewrapped[wrapped_key] = rewrapped
+            while len(self._rewrapped) > self.memo_size:
+                self._rewrapped.popitem(last=False)
+        return rewrapped
+
+    def rewrap(self, envelope, cache=key_cache):
+        """Return ``envelope`` with its data key under the current version.
+
+        Only the wrapped data key changes; the ciphertext is reused as is.
+        A data key already in ``cache`` is carried over to the new wrapping,
+        so reading the migrated envelope does not go back to the provider.
+        Text envelopes come back as text, everything else as binary.
+        """
+        fields = parse_envelope(envelope)
+        key_id, wrapped_key = fields["kid"], fields["key"]
+        if key_id != self.key_id or not self.stale(wrapped_key):
+            return envelope
+        rewrapped = self.rewrap_data_key(key_id, wrapped_key)
+        data_key = cache.get(key_id, wrapped_key) if cache is not None else None
+        if data_key is not None:
+            cache.put(key_id, rewrapped, data_key)
+            cleanUp.wipe(data_key)
+        head = _envelope_head(
+            fields["alg"], key_id, rewrapped, fields["salt"], fields["codec"]
+        )
+        migrated = _envelope(head, fields["nonce"], fields["ct"])
+        return to_text(migrated) if isinstance(envelope, str) else migrated
+
+    def rewrap_later(self, envelope, write_back, cache=key_cache):
+        """Re-wrap a stale ``envelope`` in the background after a read.
+
+        ``write_back(new_envelope)`` runs on :func:`key_fetch_executor` once
+        the new wrapping is ready, e.g. to store it back to the table it was
+        read from.  Returns the future, or ``None`` if nothing was stale.
+        """
+        fields = parse_envelope(envelope)
+        if fields["kid"] != self.key_id or not self.stale(fields["key"]):
+            return None
+
+        def _migrate():
+            write_back(self.rewrap(envelope, cache))
+
+        return key_fetch_executor().submit(_migrate)
+
+
+class DecryptResult:
+    """Outcome of one item of :func:`decrypt_many`."""
+
+    __slots__ = ("plaintext", "error")
+
+    def __init__(self, plaintext=None, error=None):
+        self.plaintext = plaintext
+        self.error = error
+
+    @property
+    def ok(self):
+        return self.error is None
+
+    def __repr__(self):
+        return "<DecryptResult ok>" if self.ok else f"<DecryptResult {self.error!r}>"
+
+
+def _parse_many(envelopes, cache):
+    """Parse ``envelopes``; returns them with ``{(kid, wrapped): cached|None}``."""
+    parsed = []
+    data_keys = {}
+    for envelope in envelopes:
+        try:
+            fields = parse_envelope(envelope)
+        except DecryptionError as exc:
+            parsed.append(exc)
+            continue
+        parsed.append(fields)
+        key = (fields["kid"], fields["key"])
+        if key not in data_keys:
+            data_keys[key] = _cache_lookup(cache, *key)
+    return parsed, data_keys
+
+
+def _batch_cipher(ciphers, fields, data_key):
+    # Envelopes from one encrypt_batch call share a salt, hence a message
+    # key: derive it and key the cipher context once for all of them.
+    group = (fields["kid"], fields["key"], fields["salt"], fields["alg"])
+    cipher = ciphers.get(group)
+    if cipher is None:
+        with metrics.timer("unwrap"):
+            message_key = _message_key(data_key, fields["salt"], fields["kid"])
+        try:
+            cipher = ciphers[group] = backends.cipher(fields["alg"], message_key)
+        finally:
+            cleanUp.wipe(message_key)
+    return cipher
+
+
+def _open_many(parsed, data_keys, alloc):
+    results = []
+    ciphers = {}
+    try:
+        for fields in parsed:
+            if isinstance(fields, Exception):
+                results.append(DecryptResult(error=fields))
+                continue
+            data_key = data_keys[(fields["kid"], fields["key"])]
+            if isinstance(data_key, Exception):
+                results.append(DecryptResult(error=data_key))
+                continue
+            nonce, sealed, aad = fields["nonce"], fields["ct"], fields["kid"].encode()
+            try:
+                cipher = _batch_cipher(ciphers, fields, data_key)
+                with metrics.timer("decrypt"):
+                    plaintext = _open_payload(
+                        cipher, nonce, sealed, aad, alloc, fields["codec"]
+                    )
+            except Exception as exc:
+                # Failed authentication or a full allocator: this item only.
+                results.append(DecryptResult(error=exc))
+                continue
+            results.append(DecryptResult(plaintext))
+    finally:
+        for cipher in ciphers.values():
+            cipher.close()
+        for data_key in data_keys.values():
+            if isinstance(data_key, bytearray):
+                cleanUp.wipe(data_key)
+    return results
+
+
+def decrypt_many(envelopes, provider=None, cache=key_cache, alloc=bytearray):
+    """Open many envelopes, unwrapping each distinct data key only once.
+
+    Envelopes sealed in the same warm container share a data key, so they
+    cost a single unwrap.  The distinct keys left after the cache are
+    unwrapped concurrently on :func:`key_fetch_executor` rather than one
+    round-trip after another.  Returns one :class:`DecryptResult` per input,
+    in order; a failure affects only the items that depend on it.
+    """
+    provider = provider or get_key_provider()
+    parsed, data_keys = _parse_many(envelopes, cache)
+
+    def _unwrap(key):
+        try:
+            return unwrap_data_key(key[0], key[1], provider, cache)
+        except Exception as exc:
+            return exc
+
+    missing = [key for key, data_key in data_keys.items() if data_key is None]
+    if len(missing) > 1:
+        unwrapped = key_fetch_executor().map(_unwrap, missing)
+    else:
+        unwrapped = map(_unwrap, missing)
+    data_keys.update(zip(missing, unwrapped))
+    return _open_many(parsed, data_keys, alloc)
+
+
+async def adecrypt_many(envelopes, provider=None, cache=key_cache, alloc=bytearray):
+    """Async :func:`decrypt_many`: unwraps are awaited together, not in series."""
+    provider = provider or get_key_provider()
+    parsed, data_keys = _parse_many(envelopes, cache)
+    missing = [key for key, data_key in data_keys.items() if data_key is None]
+    # asyncio is already loaded by whoever is awaiting us; importing it at
+    # module level would put it on every cold start.
+    import asyncio
+
+    unwrapped = await asyncio.gather(
+        *(aunwrap_data_key(key[0], key[1], provider, cache) for key in missing),
+        return_exceptions=True,
+    )
+    data_keys.update(zip(missing, unwrapped))
+    size = sum(len(fields["ct"]) for fields in parsed if isinstance(fields, dict))
+    return await _offload(size, _open_many, parsed, data_keys, alloc)
+
+
+class EncryptResult:
+    """Outcome of one record of :func:`encrypt_batch`."""
+
+    __slots__ = ("envelope", "error")
+
+    def __init__(self, envelope=None, error=None):
+        self.envelope = envelope
+        self.error = error
+
+    @property
+    def ok(self):
+        return self.error is None
+
+    def __repr__(self):
+        return "<EncryptResult ok>" if self.ok else f"<EncryptResult {self.error!r}>"
+
+
+def encrypt_batch(
+    plaintexts, key_id, provider=None, cache=key_cache, text=False, compress=None
+):
+    """Seal many records, e.g. an SQS or Kinesis batch, with one key schedule.
+
+    All records share one data key, one salt and hence one message key, so
+    the cipher context is keyed once; the per-record nonces come from a
+    single ``os.urandom`` read.  Each result is still a standalone envelope
+    -- in its :func:`to_text` form with ``text`` -- that :func:`decrypt`
+    opens, and :func:`decrypt_batch` opens a whole batch with one key
+    schedule again.  ``compress`` decides record by record.  Returns one
+    :class:`EncryptResult` per record, in order.
+    """
+    plaintexts = list(plaintexts)
+    if not plaintexts:
+        return []
+    provider = provider or get_key_provider()
+    data_key, wrapped_key = _encryption_key(key_id, provider, cache, len(plaintexts))
+    algorithm = backends.default_algorithm()
+    salt = os.urandom(SALT_SIZE)
+    message_key = _message_key(data_key, salt, key_id)
+    try:
+        cipher = backends.cipher(algorithm, message_key)
+    finally:
+        cleanUp.wipe(message_key)
+        cleanUp.wipe(data_key)
+    nonces = memoryview(os.urandom(NONCE_SIZE * len(plaintexts)))
+    heads = {None: _envelope_head(algorithm, key_id, wrapped_key, salt)}
+    aad = key_id.encode()
+    results = []
+    try:
+        for index, plaintext in enumerate(plaintexts):
+            nonce = nonces[index * NONCE_SIZE : (index + 1) * NONCE_SIZE]
+            try:
+                codec, payload = _pack(compress, plaintext)
+                sealed = cipher.seal(nonce, payload, aad)
+            except (TypeError, ValueError, CryptoError) as exc:
+                results.append(EncryptResult(error=exc))
+                continue
+            if codec not in heads:
+                heads[codec] = _envelope_head(
+                    algorithm, key_id, wrapped_key, salt, codec
+                )
+            envelope = _envelope(heads[codec], nonce, sealed)
+            results.append(EncryptResult(to_text(envelope) if text else envelope))
+    finally:
+        cipher.close()
+    return results
+
+
+def decrypt_batch(envelopes, provider=None, cache=key_cache, alloc=bytearray):
+    """Open records sealed by :func:`encrypt_batch`; see :func:`decrypt_many`.
+
+    Envelopes sharing a data key and salt share one cipher context.
+    """
+    return decrypt_many(envelopes, provider, cache, alloc)
+
+
+# Columns: the value and offset buffers of an Arrow array are read in place
+# and every output lands in one preallocated buffer, with one nonce read and
+# one key schedule per worker thread rather than an envelope object per row.
+
+
+_MAX_OFFSET_32 = 2**31 - 1
+_TOKEN_SIZE = 43  # unpadded URL-safe base64 of an HMAC-SHA256 digest
+
+
+def _arrow_type(large, string):
+    import pyarrow as pa
+
+    if string:
+        return pa.large_string() if large else pa.string()
+    return pa.large_binary() if large else pa.binary()
+
+
+def _is_large(kind):
+    import pyarrow as pa
+
+    return pa.types.is_large_binary(kind) or pa.types.is_large_string(kind)
+
+
+class _Column:
+    """A variable-width column as Arrow lays it out.
+
+    Row ``i`` is ``values[offsets[i]:offsets[i + 1]]``.  Taken from an Arrow
+    array these are views of its buffers, not copies; :meth:`build` wraps
+    output buffers back into whatever kind of column came in.
+    """
+
+    __slots__ = ("values", "offsets", "length", "code", "_nulls", "_build")
+
+    def __init__(self, values, offsets, code, nulls, build):
+        self.values = values
+        self.offsets = offsets
+        self.length = len(offsets) - 1
+        self.code = code
+        self._nulls = nulls
+        self._build = build
+
+    @classmethod
+    def from_arrow(cls, column):
+        import pyarrow as pa
+
+        kind = column.type
+        narrow = pa.types.is_binary(kind) or pa.types.is_string(kind)
+        if not (narrow or _is_large(kind)):
+            raise TypeError(f"cannot shield a {kind} column; cast it to binary")
+        code = "q" if _is_large(kind) else "i"
+        width = struct.calcsize(code)
+        _, offsets, values = column.buffers()
+        start = column.offset * width
+        offsets = memoryview(offsets)[start : start + (len(column) + 1) * width]
+        values = memoryview(values if values is not None else b"").cast("B")
+        validity = column.is_valid().buffers()[1] if column.null_count else None
+
+        def nulls():
+            valid = column.is_valid().to_pylist()
+            return [i for i, row in enumerate(valid) if not row]
+
+        def build(data, offsets, string):
+            buffers = [validity, pa.py_buffer(offsets), pa.py_buffer(data)]
+            kind = _arrow_type(code == "q", string)
+            return pa.Array.from_buffers(kind, len(column), buffers, column.null_count)
+
+        return cls(values, offsets.cast(code), code, nulls, build)
+
+    @classmethod
+    def from_sequence(cls, items):
+        rows = [item.encode() if isinstance(item, str) else item for item in items]
+        null_rows = [i for i, row in enumerate(rows) if row is None]
+        for i in null_rows:
+            rows[i] = b""
+        offsets = array.array("q", itertools.accumulate(map(len, rows), initial=0))
+
+        def build(data, offsets, string):
+            data = memoryview(data)
+            built = [bytes(data[offsets[i] : offsets[i + 1]]) for i in range(len(rows))]
+            if string:
+                built = [row.decode() for row in built]
+            for i in null_rows:
+                built[i] = None
+            return built
+
+        values = memoryview(b"".join(rows))
+        return cls(values, offsets, "q", lambda: null_rows, build)
+
+    @property
+    def starts(self):
+        return self.offsets[:-1]
+
+    @property
+    def ends(self):
+        return self.offsets[1:]
+
+    def null_rows(self):
+        return self._nulls()
+
+    def rows(self):
+        return list(map(self.values.__getitem__, map(slice, self.starts, self.ends)))
+
+    def shifted(self, delta, step):
+        """Offsets moved by ``delta``, plus ``step`` more for every row before."""
+        last = self.offsets[-1] + delta + step * self.length
+        if self.code == "i" and last > _MAX_OFFSET_32:
+            raise ValueError("column exceeds 2 GiB; use a large_binary column")
+        moves = range(delta, delta + step * (self.length + 1), step)
+        return array.array(self.code, map(operator.add, self.offsets, moves))
+
+    def build(self, data, offsets, string=False):
+        return self._build(data, offsets, string)
+
+
+def _map_column(column, shield, string=False):
+    """Apply ``shield(_Column)`` to an Arrow array, pandas Series or sequence."""
+    module = type(column).__module__.partition(".")[0]
+    if module == "pandas":
+        import pandas as pd
+        import pyarrow as pa
+
+        shielded = pd.arrays.ArrowExtensionArray(
+            _map_column(pa.array(column), shield, string)
+        )
+        return pd.Series(shielded, index=column.index, name=column.name)
+    if module == "pyarrow":
+        import pyarrow as pa
+
+        if isinstance(column, pa.ChunkedArray):
+            chunks = [shield(_Column.from_arrow(chunk)) for chunk in column.chunks]
+            return pa.chunked_array(chunks, _arrow_type(_is_large(column.type), string))
+        return shield(_Column.from_arrow(column))
+    return shield(_Column.from_sequence(column))
+
+
+def _column_ciphers(data_key, salt, key_id, algorithm, rows, workers):
+    # Each row still costs a handful of ctypes calls that hold the GIL for
+    # most of their time, so threads only pay off when asked for.
+    workers = min(workers or 1, max(rows, 1))
+    with metrics.timer("unwrap"):
+        message_key = _message_key(data_key, salt, key_id)
+    try:
+        return [backends.cipher(algorithm, message_key) for _ in range(workers)]
+    finally:
+        cleanUp.wipe(message_key)
+        cleanUp.wipe(data_key)
+
+
+def _run_rows(ciphers, count, work):
+    """Run ``work(cipher, rows)`` over ``range(count)`` split across ``ciphers``."""
+    step = max(-(-count // len(ciphers)), 1)
+    ranges = [range(start, min(start + step, count)) for start in range(0, count, step)]
+    try:
+        if len(ranges) < 2:
+            return [work(ciphers[0], rows) for rows in ranges]
+        import concurrent.futures
+
+        futures = [
+            crypto_executor().submit(work, cipher, rows)
+            for cipher, rows in zip(ciphers, ranges)
+        ]
+        # Every worker has to be done with its cipher before any is closed.
+        concurrent.futures.wait(futures)
+        return [future.result() for future in futures]
+    finally:
+        for cipher in ciphers:
+            cipher.close()
+
+
+def _seal_column(part, key_id, provider, cache, workers):
+    count = part.length
+    provider = provider or get_key_provider()
+    data_key, wrapped_key = _encryption_key(key_id, provider, cache, max(count, 1))
+    algorithm = backends.default_algorithm()
+    salt = os.urandom(SALT_SIZE)
+    head = _envelope_head(algorithm, key_id, wrapped_key, salt)
+    ciphers = _column_ciphers(data_key, salt, key_id, algorithm, count, workers)
+    offsets = part.shifted(-part.offsets[0], len(head) + NONCE_SIZE + TAG_SIZE)
+    positions = map(operator.add, offsets, itertools.repeat(len(head)))
+    positions = array.array(part.code, positions)
+    out = bytearray(offsets[-1])
+    nonces = memoryview(os.urandom(NONCE_SIZE * count))
+    aad = key_id.encode()
+
+    def seal(cipher, rows):
+        view = memoryview(out)
+        for i in rows:
+            at, nonce, drawn = offsets[i], positions[i], i * NONCE_SIZE
+            view[at:nonce] = head
+            view[nonce : nonce + NONCE_SIZE] = nonces[drawn : drawn + NONCE_SIZE]
+        cipher.seal_rows(rows, part.values, part.starts, part.ends, aad, out, positions)
+
+    with metrics.timer("encrypt"):
+        _run_rows(ciphers, count, seal)
+    return part.build(out, offsets)
+
+
+def _uniform_head(part):
+    """``(fields, header size)`` of the first row if every row shares its header.
+
+    :func:`encrypt_column` output has one key, salt and algorithm, hence one
+    envelope header repeated on every row; anything else gives ``(None,
+    None)``.
+    """
+    start, end = part.offsets[0], part.offsets[1]
+    try:
+        fields = parse_envelope(part.values[start:end])
+    except DecryptionError:
+        return None, None
+    size = end - start - NONCE_SIZE - len(fields["ct"])
+    if fields["codec"] is not None:
+        return None, None
+    if min(map(operator.sub, part.ends, part.starts)) < size + NONCE_SIZE + TAG_SIZE:
+        return None, None
+    head = bytes(part.values[start : start + size])
+    ends = map(operator.add, part.starts, itertools.repeat(size))
+    heads = map(part.values.__getitem__, map(slice, part.starts, ends))
+    if not all(map(operator.eq, heads, itertools.repeat(head))):
+        return None, None
+    return fields, size
+
+
+def _open_column_slowly(part, provider, cache):
+    # Rows from different encrypt calls, or nulls without an envelope.
+    nulls = set(part.null_rows())
+    rows = part.rows()
+    opened = decrypt_many(
+        [row for i, row in enumerate(rows) if i not in nulls], provider, cache
+    )
+    plaintexts = iter(opened)
+    values = []
+    for i in range(part.length):
+        if i in nulls:
+            values.append(b"")
+            continue
+        result = next(plaintexts)
+        if not result.ok:
+            raise DecryptionError(f"row {i} of the column: {result.error}")
+        values.append(result.plaintext)
+    offsets = array.array(part.code, itertools.accumulate(map(len, values), initial=0))
+    return part.build(bytearray(b"".join(values)), offsets)
+
+
+def _open_column(part, provider, cache, workers):
+    count = part.length
+    fields, size = _uniform_head(part) if count else (None, None)
+    if fields is None:
+        return _open_column_slowly(part, provider, cache)
+    key_id = fields["kid"]
+    data_key = unwrap_data_key(key_id, fields["key"], provider, cache)
+    ciphers = _column_ciphers(
+        data_key, fields["salt"], key_id, fields["alg"], count, workers
+    )
+    offsets = part.shifted(-part.offsets[0], -(size + NONCE_SIZE + TAG_SIZE))
+    starts = map(operator.add, part.starts, itertools.repeat(size))
+    starts = array.array(part.code, starts)
+    out = bytearray(offsets[-1])
+    aad = key_id.encode()
+
+    def open_rows(cipher, rows):
+        return cipher.open_rows(rows, part.values, starts, part.ends, aad, out, offsets)
+
+    with metrics.timer("decrypt"):
+        failed = _run_rows(ciphers, count, open_rows)
+    failed = [row for row in failed if row is not None]
+    if failed:
+        cleanUp.wipe(out)
+        raise DecryptionError(f"row {min(failed)} of the column failed authentication")
+    return part.build(out, offsets)
+
+
+def encrypt_column(column, key_id, provider=None, cache=key_cache, workers=None):
+    """Seal every value of a column in bulk, without an object per value.
+
+    ``column`` is a ``pyarrow`` binary or string array (chunked or not), a
+    ``pandas`` Series or a sequence of bytes or strings; the result is the
+    same kind of column of envelopes, nulls kept.  Arrow buffers are read
+    in place and the envelopes written into one buffer; as in
+    :func:`encrypt_batch` all rows share a data key and message key, and
+    each is a standalone envelope :func:`decrypt` opens.  Rows are sealed
+    on the calling thread unless ``workers`` asks for more; each row is
+    still a few ``ctypes`` calls, so threads help little with short rows.
+    """
+    seal = functools.partial(
+        _seal_column, key_id=key_id, provider=provider, cache=cache, workers=workers
+    )
+    return _map_column(column, seal)
+
+
+def decrypt_column(column, provider=None, cache=key_cache, workers=None):
+    """Open a column of envelopes in bulk; see :func:`encrypt_column`.
+
+    The result is a binary column (cast it back to strings where needed).
+    Columns from one :func:`encrypt_column` call are opened in place with
+    one key schedule per worker; others fall back to :func:`decrypt_many`.
+    Raises :class:`DecryptionError` naming the first row that fails.
+    """
+    opener = functools.partial(
+        _open_column, provider=provider, cache=cache, workers=workers
+    )
+    return _map_column(column, opener)
+
+
+class DeterministicKey:
+    """Key for equality tokens and deterministic encryption of identifiers.
+
+    Randomised envelopes cannot be compared without decrypting them.  For
+    columns that are joined or deduplicated on -- e-mail addresses,
+    customer IDs -- this key produces the same output for the same input in
+    every function that shares it:
+
+    * :meth:`token` -- an HMAC-SHA256 token, for equality only;
+    * :meth:`encrypt` -- deterministic, reversible encryption: a synthetic
+      IV (an HMAC of the plaintext) is the AEAD nonce, so repeated inputs,
+      and only those, repeat.
+
+    Both leak equality by design; use them for lookup keys, not secrets.
+    The key comes from a data key that is wrapped once by :meth:`generate`
+    and then distributed (an environment variable, say) to every function.
+    The derived keys are wiped by :meth:`close` and before a snapshot, and
+    derived again from the wrapped key on next use.
+    """
+
+    ALGORITHM = CHACHA20_POLY1305  # fixed: output must not depend on the host
+
+    def __init__(self, key_id, wrapped_key, provider=None, cache=key_cache):
+        self.key_id = key_id
+        self._wrapped_key = bytes(wrapped_key)
+        self._provider = provider
+        self._cache = cache
+        self._cipher = None
+        self._lock = threading.Lock()
+        with self._lock:
+            self._derive()
+        _deterministic_keys.add(self)
+
+    def _derive(self):
+        data_key = unwrap_data_key(
+            self.key_id, self._wrapped_key, self._provider, self._cache
+        )
+        info = self.key_id.encode()
+        try:
+            self._token_key = hkdf(data_key, b"", b"SDS-token-v1|" + info)
+            self._siv_key = hkdf(data_key, b"", b"SDS-siv-mac-v1|" + info)
+            encryption_key = hkdf(data_key, b"", b"SDS-siv-enc-v1|" + info)
+        finally:
+            cleanUp.wipe(data_key)
+        try:
+            self._cipher = backends.cipher(self.ALGORITHM, encryption_key)
+        finally:
+            cleanUp.wipe(encryption_key)
+
+    def _ready(self):
+        # Call with the lock held.
+        if self._cipher is None:
+            self._derive()
+
+    @staticmethod
+    def generate(key_id, provider=None):
+        """A new wrapped key to hand to :class:`DeterministicKey`."""
+        provider = provider or get_key_provider()
+        data_key, wrapped_key = provider.generate_data_key(key_id)
+        cleanUp.wipe(data_key)
+        return bytes(wrapped_key)
+
+    def token(self, value):
+        """URL-safe equality token for ``value`` (``str`` or bytes-like)."""
+        if isinstance(value, str):
+            value = value.encode()
+        with self._lock:
+            self._ready()
+            mac = hmac.new(self._token_key, value, hashlib.sha256)
+        return base64.urlsafe_b64encode(mac.digest()).rstrip(b"=").decode("ascii")
+
+    def token_column(self, column):
+        """:meth:`token` of every value of a column, as a string column.
+
+        ``column`` is anything :func:`encrypt_column` takes.  Digests are
+        computed straight from the column's buffers and base64-encoded in
+        one call, so no Python object is made per row.
+        """
+        return _map_column(column, self._tokens, string=True)
+
+    def _tokens(self, part):
+        # HMAC (RFC 2104) from inner and outer hash states keyed once: a row
+        # costs two state copies instead of setting the key up again.
+        block = bytearray(64)
+        with self._lock:
+            self._ready()
+            block[: len(self._token_key)] = self._token_key
+        pads = [block.translate(hmac.trans_36), block.translate(hmac.trans_5C)]
+        inner, outer = hashlib.sha256(pads[0]), hashlib.sha256(pads[1])
+        for buffer in (block, *pads):
+            cleanUp.wipe(buffer)
+
+        def digest(row):
+            state = inner.copy()
+            state.update(row)
+            final = outer.copy()
+            final.update(state.digest())
+            return final.digest()
+
+        rows = map(part.values.__getitem__, map(slice, part.starts, part.ends))
+        # A digest plus one zero byte encodes to 44 characters, the first 43
+        # of which are the digest's unpadded encoding: drop every 44th.
+        padded = b"\0".join(map(digest, rows)) + b"\0" if part.length else b""
+        encoded = bytearray(base64.urlsafe_b64encode(padded))
+        del encoded[_TOKEN_SIZE :: _TOKEN_SIZE + 1]
+        ends = _TOKEN_SIZE * (part.length + 1)
+        offsets = array.array(part.code, range(0, ends, _TOKEN_SIZE))
+        return part.build(encoded, offsets, string=True)
+
+    def _synthetic_iv(self, plaintext, aad):
+        mac = hmac.new(self._siv_key, struct.pack(">Q", len(aad)), hashlib.sha256)
+        mac.update(aad)
+        mac.update(plaintext)
+        return mac.digest()[:NONCE_SIZE]
+
+    def encrypt(self, plaintext, aad=b""):
+        """Deterministically seal ``plaintext``; returns ``iv || ct || tag``."""
+        if isinstance(plaintext, str):
+            plaintext = plaintext.encode()
+        with self._lock:
+            self._ready()
+            nonce = self._synthetic_iv(plaintext, aad)
+            return nonce + self._cipher.seal(nonce, plaintext, aad)
+
+    def decrypt(self, ciphertext, aad=b"", alloc=bytearray):
+        ciphertext = memoryview(ciphertext)
+        nonce, sealed = ciphertext[:NONCE_SIZE], ciphertext[NONCE_SIZE:]
+        with self._lock:
+            self._ready()
+            return _open_with(self._cipher, nonce, sealed, aad, alloc)
+
+    def close(self):
+        with self._lock:
+            if self._cipher is not None:
+                cleanUp.wipe(self._token_key)
+                cleanUp.wipe(self._siv_key)
+                self._cipher.close()
+                self._cipher = None
+
+
+_deterministic_keys = weakref.WeakSet()
+
+
+@cleanUp.register_snapshot_hook
+def _forget_deterministic_keys():
+    for key in list(_deterministic_keys):
+        key.close()
+
+
+_EACH = "[*]"
+
+
+def _path_steps(path):
+    steps = []
+    for part in path.split("."):
+        name, bracket, rest = part.partition("[")
+        rest = bracket + rest
+        if name:
+            steps.append(name)
+        while rest.startswith(_EACH):
+            steps.append(_EACH)
+            rest = rest[len(_EACH) :]
+        if rest or not part:
+            raise ValueError(f"invalid field path {path!r}")
+    return steps
+
+
+def _compile_paths(paths):
+    trie = {}
+    for path in paths:
+        steps = _path_steps(path)
+        node = trie
+        for step in steps[:-1]:
+            node = node.setdefault(step, {})
+            if node is None:
+                raise ValueError(f"field path {path!r} overlaps another")
+        if steps[-1] in node:
+            raise ValueError(f"field path {path!r} overlaps another")
+        node[steps[-1]] = None
+    return _freeze(trie)
+
+
+def _freeze(trie):
+    return tuple(
+        (step, None if child is None else _freeze(child))
+        for step, child in trie.items()
+    )
+
+
+def _apply(value, plan, transform):
+    for step, child in plan:
+        if step is _EACH:
+            if not isinstance(value, list):
+                continue
+            for index, item in enumerate(value):
+                if child is None:
+                    value[index] = transform(item)
+                else:
+                    _apply(item, child, transform)
+        elif isinstance(value, dict) and step in value:
+            if child is None:
+                value[step] = transform(value[step])
+            else:
+                _apply(value[step], child, transform)
+
+
+class FieldSchema:
+    """Fields of parsed JSON documents to shield, compiled once.
+
+    Paths are dotted keys, with ``[*]`` stepping into every element of a
+    list: ``"customer.email"``, ``"orders[*].card.number"``.  Paths sharing
+    a prefix are merged into one traversal plan, and fields missing from a
+    document are skipped.  :meth:`encrypt` replaces each field, in place,
+    with a text envelope of its JSON encoding, so numbers and nested
+    objects come back with their type from :meth:`decrypt`; the rest of the
+    document is never serialised.  One data key covers a whole document.
+
+    ``compress`` is a :class:`Compression` for every field, or a mapping
+    from some of ``paths`` to one; fields left out are not compressed.
+    """
+
+    def __init__(self, paths, compress=None):
+        self.paths = tuple(paths)
+        self._plan = _compile_paths(self.paths)
+        if not isinstance(compress, dict):
+            compress = dict.fromkeys(self.paths, compress)
+        for path in compress:
+            if path not in self.paths:
+                raise ValueError(f"compressed field {path!r} is not in the schema")
+        groups = {}
+        for path in self.paths:
+            compression = compress.get(path)
+            groups.setdefault(id(compression), (compression, []))[1].append(path)
+        self._seal_plans = tuple(
+            (compression, _compile_paths(group))
+            for compression, group in groups.values()
+        )
+
+    def encrypt(self, document, key_id, provider=None, cache=key_cache):
+        """Seal the schema's fields of ``document`` in place; returns it."""
+        provider = provider or get_key_provider()
+        data_key, wrapped_key = _encryption_key(key_id, provider, cache)
+
+        def sealer(compress):
+            def seal(value):
+                plaintext = json.dumps(value, separators=(",", ":")).encode()
+                # _seal_envelope wipes the key it is given.
+                key = bytearray(data_key)
+                envelope = _seal_envelope(plaintext, key_id, key, wrapped_key, compress)
+                return to_text(envelope)
+
+            return seal
+
+        try:
+            for compress, plan in self._seal_plans:
+                _apply(document, plan, sealer(compress))
+        finally:
+            cleanUp.wipe(data_key)
+        return document
+
+    def decrypt(self, document, provider=None, cache=key_cache):
+        """Open the schema's fields of ``document`` in place; returns it.
+
+        The restored values are ordinary Python objects and cannot be wiped.
+        """
+        data_keys = {}
+
+        def open_field(envelope):
+            fields = parse_envelope(envelope)
+            key = (fields["kid"], fields["key"])
+            if key not in data_keys:
+                data_keys[key] = unwrap_data_key(*key, provider, cache)
+            plaintext = _open(fields, data_keys[key], bytearray)
+            try:
+                return json.loads(plaintext)
+            finally:
+                cleanUp.wipe(plaintext)
+
+        try:
+            _apply(document, self._plan, open_field)
+        finally:
+            for data_key in data_keys.values():
+                cleanUp.wipe(data_key)
+        return document
+
+
+DEFAULT_CHUNK_SIZE = 64 * 1024
+STREAM_MAGIC = b"SDSS"
+STREAM_VERSION = 2
+STREAM_PREFIX_SIZE = 7
+# magic, version, algorithm id, chunk size; version 1 had no algorithm id and
+# was always ChaCha20-Poly1305.
+_STREAM_FIXED = struct.Struct(">4sBBL")
+_STREAM_FIXED_V1 = struct.Struct(">4sBL")
+
+
+def _stream_key(data_key, salt, header):
+    info = b"SDS-stream-v1|" + hashlib.sha256(header).digest()
+    return hkdf(data_key, salt, info)
+
+
+def _stream_nonce(prefix, counter, last):
+    if counter > 0xFFFFFFFF:
+        raise CryptoError("stream exceeds 2**32 chunks")
+    return prefix + struct.pack(">LB", counter, last)
+
+
+class StreamEncryptor:
+    """Incremental chunked AEAD (the STREAM construction) for large payloads.
+
+    The plaintext is cut into ``chunk_size`` pieces, each sealed under the
+    nonce ``prefix || counter || last`` so chunks cannot be reordered,
+    dropped or truncated undetected.  Every chunk but the last is exactly
+    ``chunk_size`` bytes; memory use stays at one chunk however large the
+    payload is.  Write :attr:`header` first, then the output of
+    :meth:`update` and :meth:`finalize`.
+
+    With ``compress`` the plaintext runs through its codec's streaming
+    compressor before it is chunked.  The size and entropy checks of
+    :class:`Compression` need the whole payload, so streams skip them.
+    """
+
+    def __init__(
+        self,
+        key_id,
+        provider=None,
+        cache=key_cache,
+        chunk_size=DEFAULT_CHUNK_SIZE,
+        compress=None,
+    ):
+        provider = provider or get_key_provider()
+        data_key, wrapped_key = _encryption_key(key_id, provider, cache)
+        salt = os.urandom(SALT_SIZE)
+        self._prefix = os.urandom(STREAM_PREFIX_SIZE)
+        algorithm = backends.default_algorithm()
+        codec = compress.codec if compress is not None else None
+        self._compressor = (
+            _CODECS[codec].compressobj(compress.level) if codec is not None else None
+        )
+        kid = key_id.encode()
+        fixed = _STREAM_FIXED.pack(
+            STREAM_MAGIC, STREAM_VERSION, _algorithm_byte(algorithm, codec), chunk_size
+        )
+        self.header = b"".join(
+            (
+                fixed,
+                struct.pack(">H", len(kid)),
+                kid,
+                struct.pack(">H", len(wrapped_key)),
+                wrapped_key,
+                salt,
+                self._prefix,
+            )
+        )
+        key = _stream_key(data_key, salt, self.header)
+        try:
+            self._cipher = backends.cipher(algorithm, key)
+        finally:
+            cleanUp.wipe(key)
+            cleanUp.wipe(data_key)
+        self._buffer = bytearray(chunk_size)
+        self._filled = 0
+        self._counter = 0
+
+    def _seal(self, chunk, last):
+        nonce = _stream_nonce(self._prefix, self._counter, last)
+        self._counter += 1
+        return self._cipher.seal(nonce, chunk)
+
+    def update(self, data):
+        """Buffer ``data``; returns the chunks it completed, sealed."""
+        if self._compressor is not None:
+            data = self._compressor.compress(data)
+        return self._chunk(data)
+
+    def _chunk(self, data):
+        data = memoryview(data).cast("B")
+        chunk_size = len(self._buffer)
+        sealed = []
+        while data:
+            take = min(len(data), chunk_size - self._filled)
+            self._buffer[self._filled : self._filled + take] = data[:take]
+            self._filled += take
+            data = data[take:]
+            if self._filled == chunk_size:
+                sealed.append(self._seal(self._buffer, last=False))
+                self._filled = 0
+        return b"".join(sealed)
+
+    def finalize(self):
+        """Seal the remaining (possibly empty) final chunk and wipe state."""
+        try:
+            sealed = b""
+            if self._compressor is not None:
+                sealed = self._chunk(self._compressor.flush())
+            last = self._seal(memoryview(self._buffer)[: self._filled], last=True)
+            return sealed + last
+        finally:
+            cleanUp.wipe(self._buffer)
+            self._cipher.close()
+
+
+class StreamDecryptor:
+    """Inverse of :class:`StreamEncryptor`; accepts input in any split."""
+
+    def __init__(self, provider=None, cache=key_cache):
+        self._provider = provider
+        self._cache = cache
+        self._pending = bytearray()
+        self._cipher = None
+        self._decompressor = None
+        self._done = False
+
+    def _read_header(self):
+        pending = self._pending
+        if len(pending) < _STREAM_FIXED.size + 2:
+            return False
+        if pending[4] == 1:
+            fixed = _STREAM_FIXED_V1
+            magic, version, chunk_size = fixed.unpack_from(pending)
+            algorithm, codec = CHACHA20_POLY1305, None
+        else:
+            fixed = _STREAM_FIXED
+            magic, version, algorithm_id, chunk_size = fixed.unpack_from(pending)
+            algorithm, codec = _split_algorithm_byte(algorithm_id)
+        if magic != STREAM_MAGIC or version not in (1, STREAM_VERSION):
+            raise DecryptionError("not an SDS stream")
+        if algorithm is None or not chunk_size:
+            raise DecryptionError("unsupported SDS stream parameters")
+        offset = fixed.size
+        (kid_size,) = struct.unpack_from(">H", pending, offset)
+        offset += 2 + kid_size
+        if len(pending) < offset + 2:
+            return False
+        (wrapped_size,) = struct.unpack_from(">H", pending, offset)
+        end = offset + 2 + wrapped_size + SALT_SIZE + STREAM_PREFIX_SIZE
+        if len(pending) < end:
+            return False
+        header = bytes(pending[:end])
+        key_id = header[fixed.size + 2 : offset].decode()
+        wrapped_key = header[offset + 2 : offset + 2 + wrapped_size]
+        salt = header[end - SALT_SIZE - STREAM_PREFIX_SIZE : -STREAM_PREFIX_SIZE]
+        self._prefix = header[-STREAM_PREFIX_SIZE:]
+        self._frame_size = chunk_size + TAG_SIZE
+        self._counter = 0
+        if codec is not None:
+            self._decompressor = _CODECS[codec].decompressobj()
+        data_key = unwrap_data_key(key_id, wrapped_key, self._provider, self._cache)
+        key = _stream_key(data_key, salt, header)
+        try:
+            self._cipher = backends.cipher(algorithm, key)
+        finally:
+            cleanUp.wipe(key)
+            cleanUp.wipe(data_key)
+        del pending[:end]
+        return True
+
+    def _open(self, frame, last):
+        # Yields the frame's plaintext at most a chunk at a time, so a frame
+        # that decompresses to far more is never inflated in one piece.
+        nonce = _stream_nonce(self._prefix, self._counter, last)
+        self._counter += 1
+        chunk = _open_with(self._cipher, nonce, frame, b"", bytearray)
+        if self._decompressor is None:
+            yield chunk
+            return
+        limit = self._frame_size - TAG_SIZE
+        try:
+            data = chunk
+            while True:
+                try:
+                    with metrics.timer("decompress"):
+                        piece = self._decompressor.decompress(data, limit)
+                except Exception as exc:
+                    raise DecryptionError(f"corrupt compressed stream: {exc}") from None
+                data = self._decompressor.unconsumed_tail
+                if piece:
+                    yield bytearray(piece)
+                if not data and len(piece) < limit:
+                    break
+            if last and not self._decompressor.eof:
+                raise DecryptionError("compressed stream ends mid-frame")
+        finally:
+            cleanUp.wipe(chunk)
+
+    def _pieces(self, data):
+        if self._done:
+            raise DecryptionError("data after the final chunk")
+        self._pending += data
+        if self._cipher is None and not self._read_header():
+            return
+        # A full-size frame is never the last one: the final chunk is short.
+        while len(self._pending) >= self._frame_size:
+            yield from self._open(memoryview(self._pending)[: self._frame_size], False)
+            del self._pending[: self._frame_size]
+
+    def update(self, data):
+        """Consume ciphertext; returns the plaintext of completed chunks."""
+        return _join_pieces(self._pieces(data))
+
+    def finalize(self):
+        """Open the final chunk; raises if the stream was truncated."""
+        if self._cipher is None or len(self._pending) < TAG_SIZE:
+            raise DecryptionError("truncated stream")
+        try:
+            return _join_pieces(self._open(self._pending, True))
+        finally:
+            self._done = True
+            self._pending.clear()
+            self._cipher.close()
+
+
+def _join_pieces(pieces):
+    plaintext = bytearray()
+    try:
+        for piece in pieces:
+            plaintext += piece
+            cleanUp.wipe(piece)
+    except BaseException:
+        cleanUp.wipe(plaintext)
+        raise
+    return plaintext
+
+
+def encrypt_stream(
+    src,
+    dst,
+    key_id,
+    provider=None,
+    cache=key_cache,
+    chunk_size=DEFAULT_CHUNK_SIZE,
+    compress=None,
+):
+    """Encrypt file-like ``src`` into ``dst`` holding one chunk at a time."""
+    encryptor = StreamEncryptor(key_id, provider, cache, chunk_size, compress)
+    dst.write(encryptor.header)
+    while chunk := src.read(chunk_size):
+        dst.write(encryptor.update(chunk))
+    dst.write(encryptor.finalize())
+
+
+def decrypt_stream(src, dst, provider=None, cache=key_cache, read_size=None):
+    """Decrypt file-like ``src`` produced by :func:`encrypt_stream` into ``dst``."""
+    decryptor = StreamDecryptor(provider, cache)
+    while chunk := src.read(read_size or DEFAULT_CHUNK_SIZE + TAG_SIZE):
+        # Written a piece at a time: a compressed chunk can expand a lot.
+        for piece in decryptor._pieces(chunk):
+            dst.write(piece)
+            cleanUp.wipe(piece)
+    dst.write(decryptor.finalize())
+
+
+async def aencrypt_iter(
+    chunks,
+    key_id,
+    provider=None,
+    cache=key_cache,
+    chunk_size=DEFAULT_CHUNK_SIZE,
+    compress=None,
+):
+    """Encrypt an async iterable of byte chunks, yielding ciphertext pieces.
+
+    Key fetches and chunk sealing run on worker threads, so the event loop
+    keeps serving other tasks while a large payload is processed.
+    """
+    executor = crypto_executor()
+    encryptor = await _run_blocking(
+        executor, StreamEncryptor, key_id, provider, cache, chunk_size, compress
+    )
+    yield encryptor.header
+    async for chunk in chunks:
+        sealed = await _offload(len(chunk), encryptor.update, chunk)
+        if sealed:
+            yield sealed
+    yield await _run_blocking(executor, encryptor.finalize)
+
+
+async def adecrypt_iter(chunks, provider=None, cache=key_cache):
+    """Decrypt an async iterable of ciphertext pieces, yielding plaintext."""
+    executor = crypto_executor()
+    decryptor = StreamDecryptor(provider, cache)
+    async for chunk in chunks:
+        # The first update may unwrap the data key, so it always leaves the loop.
+        plaintext = await _run_blocking(executor, decryptor.update, chunk)
+        if plaintext:
+            yield plaintext
+    yield await _run_blocking(executor, decryptor.finalize)
@@ -0,0 +1,110 @@
+"""In-process Lambda extension that holds off the freeze until cleanup is done.
+
+Lambda freezes a sandbox once the runtime *and* every registered extension
+have asked for their next event.  With this internal extension registered,
+a handler can return its response straight away and leave the wipe to
+``cleanUp.clean_up(defer=True, request_id=context.aws_request_id)``: the
+extension only asks for the next event once that request's cleanup has
+finished, so secrets are never frozen into a snapshot of the sandbox::
+
+    lambdaExtension.start()
+    cleanUp.expect_deferred()
+
+    def handler(event, context):
+        try:
+            ...
+        finally:
+            cleanUp.clean_up(defer=True, request_id=context.aws_request_id)
+
+:func:`start` must be called during INIT; outside Lambda it does nothing.
+In a process that does not defer its cleanup -- no
+:func:`~SDS.cleanUp.expect_deferred` and no deferred cleanup yet, as with
+``shielded(defer=False)`` -- the extension asks for the next event straight
+away, since the wipe has then finished before the handler returned.
+"""
+
+import json
+import logging
+import os
+import threading
+import time
+
+from . import cleanUp
+
+logger = logging.getLogger(__name__)
+
+EXTENSION_NAME = "sds-cleanup"
+API_VERSION = "2020-01-01"
+
+# Stop holding the sandbox this long before the invocation's deadline.
+DEADLINE_MARGIN = 0.2
+
+_thread = None
+_lock = threading.Lock()
+
+
+class ExtensionError(Exception):
+    """The Extensions API rejected a request."""
+
+
+def _request(connection, method, path, headers, body=None):
+    connection.request(method, f"/{API_VERSION}/extension/{path}", body, headers)
+    response = connection.getresponse()
+    payload = response.read()
+    if response.status != 200:
+        raise ExtensionError(f"{method} {path}: {response.status} {payload!r}")
+    return response, payload
+
+
+def _register(connection, name):
+    body = json.dumps({"events": ["INVOKE"]})
+    headers = {"Lambda-Extension-Name": name}
+    response, _ = _request(connection, "POST", "register", headers, body)
+    return response.getheader("Lambda-Extension-Identifier")
+
+
+def _run(connection, extension_id):
+    import http.client
+
+    headers = {"Lambda-Extension-Identifier": extension_id}
+    while True:
+        # Asking for the next event is what tells Lambda we are done.
+        try:
+            _, payload = _request(connection, "GET", "event/next", headers)
+        except (OSError, ExtensionError, http.client.HTTPException):
+            logger.exception("SDS Lambda extension stopped")
+            return
+        event = json.loads(payload)
+        if event.get("eventType") != "INVOKE":
+            return
+        if not cleanUp.deferring():
+            continue
+        remaining = event["deadlineMs"] / 1000 - time.time() - DEADLINE_MARGIN
+        request_id = event["requestId"]
+        if not cleanUp.wait_for_cleanup(request_id, max(remaining, 0.0)):
+            logger.warning("SDS cleanup for %s did not finish in time", request_id)
+
+
+def start(name=EXTENSION_NAME):
+    """Register with the Extensions API; returns whether it is running."""
+    global _thread
+    api = os.environ.get("AWS_LAMBDA_RUNTIME_API")
+    if not api:
+        return False
+    # http.client drags in ssl and email; only pay for them inside Lambda.
+    import http.client
+
+    with _lock:
+        if _thread is None:
+            # Registration has to finish before INIT does, so it is not
+            # left to the background thread.
+            connection = http.client.HTTPConnection(api)
+            extension_id = _register(connection, name)
+            _thread = threading.Thread(
+                target=_run,
+                args=(connection, extension_id),
+                name="sds-extension",
+                daemon=True,
+            )
+            _thread.start()
+    return True
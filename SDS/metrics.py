@@ -0,0 +1,172 @@
+"""Per-invocation timing breakdown for SDS hot paths.
+
+Phases are timed with :func:`timer` and counters bumped with :func:`count`;
+:func:`SDS.cleanUp.clean_up` emits the totals once per invocation as a single
+CloudWatch Embedded Metric Format (EMF) line on stdout, or as OpenTelemetry
+spans when ``SDS_METRICS=otel``.  Instrumentation is off unless
+``SDS_METRICS`` is set, and then costs one global lookup and a no-op context
+manager per timed phase.
+
+Phases: ``key_fetch`` (key service round-trips), ``unwrap`` (data key cache
+and key derivation), ``decrypt`` (AEAD), ``access`` (secure variable reads)
+and ``cleanup``.  Gauges set with :func:`gauge` report the highest value
+seen during the invocation, e.g. ``secret_locked_bytes``.
+"""
+
+import os
+import sys
+import threading
+import time
+
+NAMESPACE = "SDS"
+
+mode = os.environ.get("SDS_METRICS", "").lower() or None
+enabled = mode is not None
+
+_lock = threading.Lock()
+_timings = {}
+_counters = {}
+_gauges = {}
+_tracer = None
+
+
+class _NullTimer:
+    __slots__ = ()
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, exc_type, exc, tb):
+        return False
+
+
+_NULL_TIMER = _NullTimer()
+
+
+class _Timer:
+    __slots__ = ("name", "start", "span")
+
+    def __init__(self, name):
+        self.name = name
+        self.span = None
+
+    def __enter__(self):
+        if _tracer is not None:
+            self.span = _tracer.start_as_current_span(f"sds.{self.name}")
+            self.span.__enter__()
+        self.start = time.perf_counter_ns()
+        return self
+
+    def __exit__(self, exc_type, exc, tb):
+        record(self.name, time.perf_counter_ns() - self.start)
+        if self.span is not None:
+            self.span.__exit__(exc_type, exc, tb)
+        return False
+
+
+def enable(new_mode="emf"):
+    """Turn instrumentation on; ``new_mode`` is ``"emf"`` or ``"otel"``."""
+    global mode, enabled, _tracer
+    if new_mode == "otel":
+        from opentelemetry import trace
+
+        _tracer = trace.get_tracer("SDS")
+    else:
+        _tracer = None
+    mode = new_mode
+    enabled = True
+
+
+def disable():
+    global mode, enabled, _tracer
+    mode, enabled, _tracer = None, False, None
+    reset()
+
+
+def timer(name):
+    """Context manager timing one occurrence of phase ``name``."""
+    return _Timer(name) if enabled else _NULL_TIMER
+
+
+def record(name, elapsed_ns):
+    with _lock:
+        total, calls = _timings.get(name, (0, 0))
+        _timings[name] = (total + elapsed_ns, calls + 1)
+
+
+def count(name, value=1):
+    if enabled:
+        with _lock:
+            _counters[name] = _counters.get(name, 0) + value
+
+
+def gauge(name, value):
+    """Record a level; the invocation reports the highest one."""
+    if enabled:
+        with _lock:
+            if name not in _gauges or value > _gauges[name]:
+                _gauges[name] = value
+
+
+def snapshot():
+    """Totals since the last reset: ``{phase_ms, phase_count, counter, gauge}``."""
+    with _lock:
+        values = {}
+        for name, (total, calls) in _timings.items():
+            values[f"{name}_ms"] = total / 1e6
+            values[f"{name}_count"] = calls
+        values.update(_counters)
+        values.update(_gauges)
+        return values
+
+
+def reset():
+    with _lock:
+        _timings.clear()
+        _counters.clear()
+        _gauges.clear()
+
+
+def emit(stream=None, dimensions=None):
+    """Write the invocation's metrics as one EMF line and start over.
+
+    OpenTelemetry mode has already exported spans, so nothing is written.
+    Returns the emitted values.
+    """
+    values = snapshot()
+    reset()
+    if not values or mode == "otel":
+        return values
+    if dimensions is None:
+        function = os.environ.get("AWS_LAMBDA_FUNCTION_NAME")
+        dimensions = {"FunctionName": function} if function else {}
+    units = {name: _unit(name) for name in values}
+    document = {
+        "_aws": {
+            "Timestamp": int(time.time() * 1000),
+            "CloudWatchMetrics": [
+                {
+                    "Namespace": NAMESPACE,
+                    "Dimensions": [list(dimensions)],
+                    "Metrics": [
+                        {"Name": name, "Unit": unit} for name, unit in units.items()
+                    ],
+                }
+            ],
+        },
+        **dimensions,
+        **values,
+    }
+    import json
+
+    stream = stream or sys.stdout
+    stream.write(json.dumps(document, separators=(",", ":")) + "\n")
+    return values
+
+
+def _unit(name):
+    if name.endswith("_ms"):
+        return "Milliseconds"
+    if name.endswith("_bytes"):
+        return "Bytes"
+    return "Count"
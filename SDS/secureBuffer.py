@@ -0,0 +1,520 @@
+"""Pinned, non-dumpable memory for plaintext secrets.
+
+A :class:`SecureBuffer` lives in an anonymous ``mmap`` region that is
+``mlock``ed (best effort: ``RLIMIT_MEMLOCK`` may refuse it) and excluded from
+core dumps.  Callers get ``memoryview``s into it, so slicing, hashing or
+writing a secret to a socket never creates a ``bytes`` copy that would escape
+the wipe.
+
+Small secrets are carved out of a per-invocation :class:`SecretArena` by
+:func:`allocate`; :mod:`SDS.cleanUp` then wipes them all with one ``memset``
+instead of visiting each buffer.  Larger ones are tracked individually and
+closed by the same cleanup.
+
+A :class:`SharedSegment` holds secrets decrypted once in a pre-fork master
+process (gunicorn, uWSGI) for all of its workers to read.
+"""
+
+import bisect
+import ctypes
+import fcntl
+import hashlib
+import hmac
+import logging
+import mmap
+import os
+import threading
+import weakref
+
+from . import cleanUp
+
+logger = logging.getLogger(__name__)
+
+_libc = ctypes.CDLL(None, use_errno=True)
+
+
+def _address(region):
+    anchor = ctypes.c_char.from_buffer(region)
+    try:
+        return ctypes.addressof(anchor)
+    finally:
+        del anchor
+
+
+def _round_to_pages(size):
+    return max(mmap.PAGESIZE, -(-size // mmap.PAGESIZE) * mmap.PAGESIZE)
+
+
+def _lock_pages(address, size):
+    if _libc.mlock(ctypes.c_void_p(address), ctypes.c_size_t(size)) == 0:
+        return True
+    logger.debug("mlock failed: %s", os.strerror(ctypes.get_errno()))
+    return False
+
+
+def _map_locked(size):
+    """Map ``size`` bytes of anonymous memory; returns ``(region, addr, locked)``."""
+    region = mmap.mmap(-1, _round_to_pages(size), flags=mmap.MAP_PRIVATE)
+    address = _address(region)
+    if hasattr(mmap, "MADV_DONTDUMP"):
+        region.madvise(mmap.MADV_DONTDUMP)
+    return region, address, _lock_pages(address, len(region))
+
+
+class SecureBuffer:
+    """A fixed-size plaintext buffer in locked, non-dumpable memory."""
+
+    def __init__(self, size):
+        self._size = size
+        self._offset = 0
+        self._region, self._address, self.locked = _map_locked(size)
+        self._closed = False
+
+    @classmethod
+    def from_bytes(cls, data):
+        """Copy ``data`` in; the caller remains responsible for wiping it."""
+        data = memoryview(data).cast("B")
+        buffer = cls(data.nbytes)
+        buffer.writable()[:] = data
+        return buffer
+
+    def __len__(self):
+        return self._size
+
+    @property
+    def closed(self):
+        return self._closed
+
+    @property
+    def footprint(self):
+        """Bytes of memory this buffer holds on to, page rounding included."""
+        return 0 if self.closed else len(self._region)
+
+    def writable(self):
+        """Writable view, for code that fills the buffer (e.g. decryption)."""
+        if self.closed:
+            raise ValueError("SecureBuffer is closed")
+        return memoryview(self._region)[self._offset : self._offset + self._size]
+
+    def view(self):
+        """Read-only view of the plaintext; slicing it never copies."""
+        return self.writable().toreadonly()
+
+    def digest(self, name="sha256"):
+        """Hash the plaintext without materialising it as ``bytes``."""
+        return hashlib.new(name, self.view()).digest()
+
+    def equals(self, other):
+        """Constant-time comparison against another bytes-like object."""
+        return hmac.compare_digest(self.view(), other)
+
+    def wipe(self):
+        if not self.closed:
+            ctypes.memset(self._address + self._offset, 0, self._size)
+
+    def resident(self):
+        """Writable view of whatever memory is still mapped, or ``None``.
+
+        Once closed this should read as zeros; see
+        :func:`SDS.cleanUp.verify_wiped`.
+        """
+        if self._region.closed:
+            return None
+        return memoryview(self._region)
+
+    def close(self):
+        """Wipe, unlock and unmap the region.
+
+        If views are still exported the region cannot be unmapped, but it is
+        wiped and the buffer refuses further use either way.
+        """
+        if self._closed:
+            return
+        ctypes.memset(self._address, 0, len(self._region))
+        if self.locked:
+            size = ctypes.c_size_t(len(self._region))
+            _libc.munlock(ctypes.c_void_p(self._address), size)
+        self._closed = True
+        try:
+            self._region.close()
+        except BufferError:
+            pass
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, exc_type, exc, tb):
+        self.close()
+
+    def __del__(self):
+        try:
+            self.close()
+        except Exception:
+            pass
+
+    def __repr__(self):
+        state = "closed" if self.closed else f"{self._size} bytes"
+        return f"<{type(self).__name__} {state}>"
+
+
+class ArenaBuffer(SecureBuffer):
+    """A :class:`SecureBuffer` occupying one slot of a :class:`SecretArena`."""
+
+    def __init__(self, arena, offset, size, slot_size):
+        self._arena = arena
+        self._generation = arena.generation
+        self._region = arena._region
+        self._address = arena._address
+        self._offset = offset
+        self._size = size
+        self._slot_size = slot_size
+        self.locked = arena.locked
+        self._closed = False
+
+    @property
+    def closed(self):
+        return self._closed or self._generation != self._arena.generation
+
+    @property
+    def footprint(self):
+        return 0 if self.closed else self._slot_size
+
+    def resident(self):
+        if self._region.closed:
+            return None
+        return memoryview(self._region)[self._offset : self._offset + self._slot_size]
+
+    def close(self):
+        """Wipe the slot and return it to the arena's free list."""
+        if self.closed:
+            return
+        ctypes.memset(self._address + self._offset, 0, self._slot_size)
+        self._closed = True
+        self._arena._release(self._offset, self._slot_size, self._generation)
+
+
+class SecretArena:
+    """One locked region sliced into fixed size classes.
+
+    Slots are handed out bump-pointer style and recycled through per-class
+    free lists.  :meth:`reset` wipes every slot at once, returns the pages to
+    the kernel where they are not locked, and invalidates all outstanding
+    :class:`ArenaBuffer`s, leaving the arena empty and unfragmented for the
+    next invocation.  Requests larger than the biggest class, or that do not
+    fit, get a standalone :class:`SecureBuffer`.
+    """
+
+    SIZE_CLASSES = (32, 64, 128, 256, 512, 1024, 4096)
+
+    def __init__(self, size=1 << 20):
+        self._region, self._address, self.locked = _map_locked(size)
+        self._lock = threading.Lock()
+        self._top = 0
+        self._free = {slot_size: [] for slot_size in self.SIZE_CLASSES}
+        self.generation = 0
+
+    @property
+    def capacity(self):
+        return len(self._region)
+
+    @property
+    def used(self):
+        """Bytes of the region handed out since the last :meth:`reset`."""
+        return self._top
+
+    def allocate(self, size):
+        index = bisect.bisect_left(self.SIZE_CLASSES, max(size, 1))
+        if index == len(self.SIZE_CLASSES):
+            return SecureBuffer(size)
+        slot_size = self.SIZE_CLASSES[index]
+        with self._lock:
+            free = self._free[slot_size]
+            if free:
+                offset = free.pop()
+            elif self._top + slot_size <= len(self._region):
+                offset = self._top
+                self._top += slot_size
+            else:
+                return SecureBuffer(size)
+            return ArenaBuffer(self, offset, size, slot_size)
+
+    def _release(self, offset, slot_size, generation):
+        with self._lock:
+            if generation == self.generation:
+                self._free[slot_size].append(offset)
+
+    def reset(self):
+        """Wipe every slot in one pass and start the arena over."""
+        with self._lock:
+            if self._top:
+                ctypes.memset(self._address, 0, self._top)
+                if not self.locked:
+                    # Locked pages cannot be discarded; the memset suffices.
+                    self._region.madvise(
+                        mmap.MADV_DONTNEED, 0, _round_to_pages(self._top)
+                    )
+            self._top = 0
+            for free in self._free.values():
+                free.clear()
+            self.generation += 1
+
+    def close(self):
+        self.reset()
+        if self.locked:
+            size = ctypes.c_size_t(len(self._region))
+            _libc.munlock(ctypes.c_void_p(self._address), size)
+            self.locked = False
+        try:
+            self._region.close()
+        except BufferError:
+            pass
+
+
+_arena = None
+_arena_lock = threading.Lock()
+_hooks_registered = False
+
+
+def default_arena():
+    """The per-container arena, mapped on first use and reset per invocation."""
+    global _arena, _hooks_registered
+    with _arena_lock:
+        if _arena is None:
+            size = int(os.environ.get("SDS_ARENA_SIZE", str(1 << 20)))
+            _arena = SecretArena(size)
+            if not _hooks_registered:
+                cleanUp.register_invocation_hook(_reset_default_arena)
+                cleanUp.register_shutdown_hook(_close_default_arena)
+                cleanUp.register_wipe_check(_default_arena_resident)
+                _hooks_registered = True
+        return _arena
+
+
+def _reset_default_arena():
+    arena = _arena
+    if arena is not None:
+        arena.reset()
+
+
+def _default_arena_resident():
+    # All of it, not just what was handed out: reset() must leave no slot.
+    arena = _arena
+    if arena is None or arena._region.closed:
+        return []
+    return [memoryview(arena._region)]
+
+
+def _close_default_arena():
+    # A later allocation maps a fresh arena rather than using a closed one.
+    global _arena
+    with _arena_lock:
+        arena, _arena = _arena, None
+    if arena is not None:
+        arena.close()
+
+
+def allocate(size):
+    """Allocate a secret buffer from the default arena.
+
+    Waits for a deferred :func:`~SDS.cleanUp.clean_up` to finish first, so a
+    new invocation's secrets are never handed a slot that is about to be
+    wiped.
+    """
+    cleanUp.begin_invocation()
+    buffer = default_arena().allocate(size)
+    if not isinstance(buffer, ArenaBuffer):
+        # Too big for the arena, so the arena reset will not wipe it.
+        cleanUp.track(buffer)
+    return buffer
+
+
+class SharedBuffer(SecureBuffer):
+    """One secret inside a :class:`SharedSegment`.
+
+    Its lifetime is the segment's: :meth:`close` only lets go of this
+    handle, and the plaintext is wiped when the last process detaches.
+    """
+
+    def __init__(self, segment, offset, size):
+        self._segment = segment
+        self._region = segment._region
+        self._address = segment._address
+        self._offset = offset
+        self._size = size
+        self.locked = segment.locked
+        self._closed = False
+
+    @property
+    def closed(self):
+        return self._segment.closed
+
+    @property
+    def footprint(self):
+        # Counted once, by the segment, however many contexts read it.
+        return 0
+
+    def resident(self):
+        # The segment keeps the plaintext for other processes by design.
+        return None
+
+    def writable(self):
+        if self._segment.sealed:
+            raise ValueError("SharedSegment is sealed read-only")
+        return super().writable()
+
+    def view(self):
+        if self.closed:
+            raise ValueError("SharedSegment is closed")
+        end = self._offset + self._size
+        return memoryview(self._region)[self._offset : end].toreadonly()
+
+    def wipe(self):
+        pass
+
+    def close(self):
+        pass
+
+
+_segments = weakref.WeakSet()
+_segment_hook_registered = False
+
+
+def _shared_file():
+    # The backing file and two more open file descriptions of it, which only
+    # a path can give: one for the hold lock and one to probe it with.
+    if hasattr(os, "memfd_create"):
+        fd = os.memfd_create("sds-shared-secrets")
+        path = f"/proc/self/fd/{fd}"
+        return fd, os.open(path, os.O_RDONLY), os.open(path, os.O_RDONLY)
+    import tempfile
+
+    fd, path = tempfile.mkstemp(prefix="sds-shared-")
+    try:
+        return fd, os.open(path, os.O_RDONLY), os.open(path, os.O_RDONLY)
+    finally:
+        os.unlink(path)
+
+
+class SharedSegment:
+    """Locked, non-dumpable memory that forked workers map read-only.
+
+    Decrypt into it in the master before forking -- :meth:`allocate` is an
+    ``alloc`` for :func:`SDS.cryptoHandler.decrypt` -- then :meth:`seal` it:
+    the pages become read-only, and forked workers inherit them that way.
+    Every process that maps the segment shares a ``flock`` hold on one open
+    file description, which ``fork`` hands a worker along with the mapping,
+    so a worker is attached from the moment it exists.
+    :meth:`detach` (run by :func:`SDS.cleanUp.shutdown`) closes this
+    process's handle on it and, if no other process still holds it, wipes
+    the plaintext.  The kernel drops the hold of a worker that ends without
+    detaching (``os._exit``, ``exec``, ``SIGKILL``), so the next process to
+    detach still wipes; only if that worker was the last one does the wipe
+    wait for the kernel to reclaim the pages.
+
+    The master stays attached so that the workers it forks later inherit
+    the secrets too, which means the plaintext outlives every worker until
+    the master shuts down.  Call :meth:`detach` in the master once it will
+    fork no more workers to have the last worker out wipe it instead.
+    """
+
+    _ALIGN = 16
+
+    def __init__(self, size=1 << 16):
+        self._fd, self._hold, self._probe = _shared_file()
+        size = _round_to_pages(size)
+        os.ftruncate(self._fd, size)
+        fcntl.flock(self._hold, fcntl.LOCK_SH)
+        self._region = mmap.mmap(self._fd, size, flags=mmap.MAP_SHARED)
+        self._address = _address(self._region)
+        if hasattr(mmap, "MADV_DONTDUMP"):
+            self._region.madvise(mmap.MADV_DONTDUMP)
+        self.locked = _lock_pages(self._address, size)
+        self._lock = threading.Lock()
+        self._top = 0
+        self.sealed = False
+        self.closed = False
+        _register_segment(self)
+
+    def allocate(self, size):
+        with self._lock:
+            if self.sealed or self.closed:
+                raise ValueError("SharedSegment no longer accepts secrets")
+            offset = self._top
+            if offset + size > len(self._region):
+                raise MemoryError("SharedSegment is full")
+            self._top += -(-max(size, 1) // self._ALIGN) * self._ALIGN
+        return SharedBuffer(self, offset, size)
+
+    def _protect(self, prot):
+        address = ctypes.c_void_p(self._address)
+        size = ctypes.c_size_t(len(self._region))
+        if _libc.mprotect(address, size, prot) != 0:
+            raise OSError(ctypes.get_errno(), "mprotect failed")
+
+    def seal(self):
+        """Make the secrets read-only; do this before forking workers."""
+        with self._lock:
+            self._protect(mmap.PROT_READ)
+            self.sealed = True
+        return self
+
+    def _after_fork_in_child(self):
+        self._lock = threading.Lock()
+        if not self.closed:
+            self.locked = _lock_pages(self._address, len(self._region))
+
+    def detach(self):
+        """Give up this process's hold; the last process out wipes the secrets."""
+        with self._lock:
+            if self.closed:
+                return
+            self.closed = True
+        # Other processes keep the hold description open, and with it the
+        # shared lock, so the exclusive probe only succeeds for the last one.
+        os.close(self._hold)
+        try:
+            fcntl.flock(self._probe, fcntl.LOCK_EX | fcntl.LOCK_NB)
+        except BlockingIOError:
+            pass
+        else:
+            self._protect(mmap.PROT_READ | mmap.PROT_WRITE)
+            ctypes.memset(self._address, 0, len(self._region))
+        os.close(self._probe)
+        if self.locked:
+            size = ctypes.c_size_t(len(self._region))
+            _libc.munlock(ctypes.c_void_p(self._address), size)
+            self.locked = False
+        try:
+            self._region.close()
+        except BufferError:
+            pass
+        os.close(self._fd)
+
+    def __del__(self):
+        try:
+            self.detach()
+        except Exception:
+            pass
+
+
+def _register_segment(segment):
+    # One hook for every segment: a hook per segment would keep each alive.
+    global _segment_hook_registered
+    _segments.add(segment)
+    if not _segment_hook_registered:
+        _segment_hook_registered = True
+        cleanUp.register_shutdown_hook(_detach_segments)
+
+
+def _detach_segments():
+    for segment in list(_segments):
+        segment.detach()
+
+
+def _after_fork_in_child():
+    for segment in list(_segments):
+        segment._after_fork_in_child()
+
+
+if hasattr(os, "register_at_fork"):
+    os.register_at_fork(after_in_child=_after_fork_in_child)
@@ -0,0 +1,673 @@
+"""Secure variables and the per-invocation context that holds them.
+
+A :class:`SecureContext` is handed a bag of envelopes but pays nothing for
+them up front: each :class:`SecureVar` keeps only its ciphertext until the
+first :meth:`SecureVar.reveal`, then caches the plaintext in a locked
+:class:`~SDS.secureBuffer.SecureBuffer` until the context is closed.
+
+Plaintext buffers come from the per-invocation arena, so a variable whose
+buffer was wiped by :func:`SDS.cleanUp.clean_up` simply decrypts again on its
+next access.
+
+Variables and contexts may be shared by the threads of one invocation.  Only
+the first reader of a variable decrypts it, under that variable's own lock;
+everyone else reads the published buffer without taking any lock.
+"""
+
+import collections
+import functools
+import hashlib
+import itertools
+import os
+import threading
+import weakref
+
+from . import backends, cleanUp, cryptoHandler, metrics, secureBuffer
+
+
+# Orders variable accesses for cold-first eviction without taking a lock.
+_clock = itertools.count()
+
+
+def _live(plaintext):
+    return plaintext is not None and not plaintext.closed
+
+
+class SecureVar:
+    """One secret, decrypted on first access."""
+
+    __slots__ = (
+        "_envelope",
+        "_provider",
+        "_cache",
+        "_plaintext",
+        "_lock",
+        "_version",
+        "_owner",
+        "_last_access",
+        "_charge",
+    )
+
+    def __init__(self, envelope, provider=None, cache=cryptoHandler.key_cache):
+        self._envelope = envelope
+        self._provider = provider
+        self._cache = cache
+        self._plaintext = None
+        self._lock = threading.Lock()
+        self._version = None
+        self._owner = None
+        self._last_access = 0
+        self._charge = None
+
+    @classmethod
+    def seal(cls, plaintext, key_id, provider=None, cache=cryptoHandler.key_cache):
+        """Encrypt ``plaintext`` and wrap the resulting envelope."""
+        envelope = cryptoHandler.encrypt(plaintext, key_id, provider, cache)
+        return cls(envelope, provider, cache)
+
+    @property
+    def envelope(self):
+        return self._envelope
+
+    @property
+    def decrypted(self):
+        return _live(self._plaintext)
+
+    @property
+    def version(self):
+        """Identifies the secret's ciphertext and its wrapped data key.
+
+        Stable across invocations; it changes when the secret is re-encrypted
+        or its data key is re-wrapped, e.g. by key rotation.
+        """
+        if self._version is None:
+            fields = cryptoHandler.parse_envelope(self._envelope)
+            digest = hashlib.sha256(fields["kid"].encode())
+            for part in (fields["key"], fields["nonce"], fields["ct"]):
+                digest.update(part)
+            self._version = digest.hexdigest()[:32]
+        return self._version
+
+    def _buffer(self):
+        plaintext = self._plaintext
+        self._last_access = next(_clock)
+        if _live(plaintext):
+            return plaintext
+        with self._lock:
+            # Another thread may have decrypted while we waited for the lock.
+            plaintext = self._plaintext
+            decrypted = not _live(plaintext)
+            if decrypted:
+                plaintext = self._plaintext = cryptoHandler.decrypt(
+                    self._envelope, self._provider, self._cache, secureBuffer.allocate
+                )
+        if decrypted:
+            self._admitted()
+        return plaintext
+
+    def _publish(self, plaintext):
+        """Install ``plaintext`` unless a live one won the race; returns the winner."""
+        with self._lock:
+            installed = not _live(self._plaintext)
+            if installed:
+                self._plaintext = plaintext
+            else:
+                plaintext.close()
+            plaintext = self._plaintext
+        self._last_access = next(_clock)
+        if installed:
+            self._admitted()
+        return plaintext
+
+    def _admitted(self):
+        owner = self._owner
+        if owner is not None:
+            owner._admit(self)
+
+    def reveal(self):
+        """Return a read-only view of the plaintext, decrypting it if needed."""
+        with metrics.timer("access"):
+            return self._buffer().view()
+
+    async def areveal(self):
+        """Async :meth:`reveal`; the key fetch does not block the event loop.
+
+        The lock is not held across the await, so concurrent first readers
+        may each decrypt; only one result is kept.
+        """
+        with metrics.timer("access"):
+            plaintext = self._plaintext
+            if not _live(plaintext):
+                decrypted = await cryptoHandler.adecrypt(
+                    self._envelope, self._provider, self._cache, secureBuffer.allocate
+                )
+                plaintext = self._publish(decrypted)
+            return plaintext.view()
+
+    def text(self, encoding="utf-8"):
+        """Decode the plaintext; the returned ``str`` cannot be wiped."""
+        return str(self.reveal(), encoding)
+
+    def digest(self, name="sha256"):
+        """Hash the plaintext without copying it out of its buffer."""
+        return self._buffer().digest(name)
+
+    def equals(self, other):
+        """Constant-time comparison, e.g. for checking a presented token."""
+        return self._buffer().equals(other)
+
+    def wipe(self):
+        """Zero the cached plaintext; the next :meth:`reveal` decrypts again."""
+        if self._plaintext is None:
+            return
+        with self._lock:
+            plaintext, self._plaintext = self._plaintext, None
+        if plaintext is not None:
+            plaintext.close()
+        if self._charge is not None:
+            self._owner._discharge(self)
+
+    def __repr__(self):
+        state = "decrypted" if self.decrypted else "sealed"
+        return f"<SecureVar {state}>"
+
+
+def _default_memory_cap():
+    cap = os.environ.get("SDS_MEMORY_CAP")
+    return int(cap) if cap else None
+
+
+# Read once: contexts are built on every invocation.
+_DEFAULT_MEMORY_CAP = _default_memory_cap()
+
+
+class SecureContext:
+    """Named secure variables for one invocation.
+
+    Also memoises :meth:`tokenize` in a bounded LRU of ``token_cache_size``
+    entries, so an identifier repeated across a batch is hashed once.
+
+    :meth:`memory` reports the secret memory its decrypted variables hold,
+    which is also published as ``secret_*_bytes`` gauges.  Once that passes
+    ``memory_cap`` bytes (``SDS_MEMORY_CAP``; unlimited by default), the
+    least recently read variables are wiped back to ciphertext-only until it
+    fits again; they decrypt anew on their next read.  Views of an evicted
+    variable read zeros, so keep ``reveal()`` views short-lived under a cap.
+    The cap covers only the memory holding this context's plaintexts, not
+    the container-wide :func:`~SDS.secureBuffer.default_arena` its small
+    secrets are carved from: its ``SDS_ARENA_SIZE`` bytes (1 MiB by default)
+    stay mapped, and locked where ``RLIMIT_MEMLOCK`` allows, whatever the
+    cap, so budget for them separately.
+    """
+
+    def __init__(
+        self,
+        secrets=None,
+        provider=None,
+        cache=cryptoHandler.key_cache,
+        token_cache_size=4096,
+        memory_cap=None,
+    ):
+        self._provider = provider
+        self._cache = cache
+        self._vars = {}
+        self._tokens = collections.OrderedDict()
+        self._token_cache_size = token_cache_size
+        self._token_lock = threading.Lock()
+        if memory_cap is None:
+            memory_cap = _DEFAULT_MEMORY_CAP
+        self.memory_cap = memory_cap
+        # Running totals of memory(), charged per variable as it is admitted.
+        self._usage = [0, 0, 0]
+        self._memory_lock = threading.RLock()
+        for name, envelope in (secrets or {}).items():
+            self.add(name, envelope)
+
+    def add(self, name, envelope):
+        var = SecureVar(envelope, self._provider, self._cache)
+        var._owner = self
+        self._vars[name] = var
+        return var
+
+    def __getitem__(self, name):
+        return self._vars[name]
+
+    def __contains__(self, name):
+        return name in self._vars
+
+    def __iter__(self):
+        return iter(self._vars)
+
+    def __len__(self):
+        return len(self._vars)
+
+    def reveal(self, name):
+        return self._vars[name].reveal()
+
+    def load(self, names=None):
+        """Decrypt several variables in one batch ahead of first access.
+
+        Data keys are unwrapped through :func:`cryptoHandler.decrypt_many`, so
+        N secrets cost one key-service round-trip per distinct data key
+        instead of N serial ones.  Returns ``{name: exception}`` for the
+        variables that failed; those stay sealed and raise on ``reveal()``.
+        """
+        pending = self._pending(names)
+        results = cryptoHandler.decrypt_many(
+            [self._vars[name].envelope for name in pending],
+            self._provider,
+            self._cache,
+            secureBuffer.allocate,
+        )
+        return self._store(pending, results)
+
+    async def aload(self, names=None):
+        """Async :meth:`load`, built on :func:`cryptoHandler.adecrypt_many`."""
+        pending = self._pending(names)
+        results = await cryptoHandler.adecrypt_many(
+            [self._vars[name].envelope for name in pending],
+            self._provider,
+            self._cache,
+            secureBuffer.allocate,
+        )
+        return self._store(pending, results)
+
+    async def areveal(self, name):
+        return await self._vars[name].areveal()
+
+    def memory(self):
+        """Bytes held by decrypted variables: ``plaintext``, ``secret``, ``locked``.
+
+        ``secret_bytes`` counts the memory holding the plaintexts -- arena
+        slots, whole pages for larger buffers -- and ``locked_bytes`` the part
+        of it that is ``mlock``ed against ``RLIMIT_MEMLOCK``.  Plaintexts in a
+        :class:`~SDS.secureBuffer.SharedSegment` belong to the segment and
+        add no ``secret_bytes``.
+        """
+        plaintext = secret = locked = 0
+        for var in list(self._vars.values()):
+            buffer = var._plaintext
+            if not _live(buffer):
+                continue
+            footprint = buffer.footprint
+            plaintext += len(buffer)
+            secret += footprint
+            if buffer.locked:
+                locked += footprint
+        return {
+            "plaintext_bytes": plaintext,
+            "secret_bytes": secret,
+            "locked_bytes": locked,
+        }
+
+    def _admit(self, var):
+        # Called after ``var`` gains a plaintext: enforce the cap, then report.
+        cap = self.memory_cap
+        if cap is None and not metrics.enabled:
+            return
+        buffer = var._plaintext
+        if not _live(buffer):
+            return
+        footprint = buffer.footprint
+        charge = (len(buffer), footprint, footprint if buffer.locked else 0)
+        with self._memory_lock:
+            self._account(var._charge, -1)
+            var._charge = charge
+            self._account(charge, 1)
+            if cap is not None and self._usage[1] > cap:
+                self._evict(var, cap)
+            usage = dict(zip(("plaintext", "secret", "locked"), self._usage))
+        for name, value in usage.items():
+            metrics.gauge(f"secret_{name}_bytes", value)
+
+    def _account(self, charge, sign):
+        if charge is not None:
+            for i, size in enumerate(charge):
+                self._usage[i] += sign * size
+
+    def _discharge(self, var):
+        with self._memory_lock:
+            self._account(var._charge, -1)
+            var._charge = None
+
+    def _recount(self):
+        # Buffers closed behind the context's back (an arena reset) drop out.
+        self._usage = [0, 0, 0]
+        for var in self._vars.values():
+            buffer = var._plaintext
+            if var._charge is not None and not _live(buffer):
+                var._charge = None
+            self._account(var._charge, 1)
+
+    def _evict(self, keep, cap):
+        self._recount()
+        excess = self._usage[1] - cap
+        cold = []
+        for var in self._vars.values():
+            buffer = var._plaintext
+            if var is not keep and _live(buffer) and buffer.footprint:
+                cold.append((var._last_access, buffer.footprint, var))
+        cold.sort(key=lambda entry: entry[0])
+        evicted = 0
+        for _, footprint, var in cold:
+            if excess <= 0:
+                break
+            var.wipe()
+            excess -= footprint
+            evicted += 1
+        if evicted:
+            metrics.count("secrets_evicted", evicted)
+
+    def _pending(self, names):
+        names = list(self._vars if names is None else names)
+        return [name for name in names if not self._vars[name].decrypted]
+
+    def _store(self, names, results):
+        errors = {}
+        for name, result in zip(names, results):
+            if result.ok:
+                self._vars[name]._publish(result.plaintext)
+            else:
+                errors[name] = result.error
+        return errors
+
+    def tokenize(self, key, value):
+        """``key.token(value)`` for a :class:`~SDS.cryptoHandler.DeterministicKey`."""
+        entry = (key, value if isinstance(value, str) else bytes(value))
+        with self._token_lock:
+            token = self._tokens.get(entry)
+            if token is not None:
+                self._tokens.move_to_end(entry)
+                return token
+        token = key.token(value)
+        with self._token_lock:
+            self._tokens[entry] = token
+            if len(self._tokens) > self._token_cache_size:
+                self._tokens.popitem(last=False)
+        return token
+
+    def close(self):
+        """Wipe every plaintext decrypted through this context."""
+        for var in self._vars.values():
+            var.wipe()
+        with self._token_lock:
+            self._tokens.clear()
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, exc_type, exc, tb):
+        self.close()
+
+    async def __aenter__(self):
+        return self
+
+    async def __aexit__(self, exc_type, exc, tb):
+        self.close()
+
+
+class SecretManifest:
+    """Declarative list of the secrets a handler needs.
+
+    ``secrets`` maps names to envelopes, ``env`` maps names to environment
+    variables holding envelopes in text form, read on first use and not
+    looked up again.  Build the manifest at module level and call
+    :meth:`prefetch` so key fetches and decryption overlap the rest of the
+    Lambda INIT phase; the handler's :meth:`context` then finds them already
+    resolved::
+
+        MANIFEST = SecretManifest(env={"db": "DB_PASSWORD"}).prefetch()
+
+        def handler(event, context):
+            with MANIFEST.context() as ctx:
+                ...
+    """
+
+    def __init__(
+        self, secrets=None, env=None, provider=None, cache=cryptoHandler.key_cache
+    ):
+        self._secrets = dict(secrets or {})
+        self._env = dict(env or {})
+        self._provider = provider
+        self._cache = cache
+        self._prefetched = None
+        self._shared = None
+        self._resolved = None
+        self.segment = None
+        _manifests.add(self)
+
+    def envelopes(self):
+        if self._resolved is None:
+            resolved = dict(self._secrets)
+            for name, variable in self._env.items():
+                resolved[name] = os.environ[variable]
+            self._resolved = resolved
+        return self._resolved
+
+    def _decrypt_all(self, envelopes):
+        results = cryptoHandler.decrypt_many(
+            list(envelopes.values()),
+            self._provider,
+            self._cache,
+            secureBuffer.allocate,
+        )
+        return dict(zip(envelopes, results))
+
+    def prefetch(self):
+        """Start unwrapping and decrypting every secret in the background."""
+        if self._prefetched is None:
+            envelopes = self.envelopes()
+            self._prefetched = cryptoHandler.crypto_executor().submit(
+                self._decrypt_all, envelopes
+            )
+        return self
+
+    def share(self):
+        """Decrypt every secret once into a :class:`~SDS.secureBuffer.SharedSegment`.
+
+        Call it in a pre-fork master (gunicorn with ``preload_app``): every
+        context built afterwards, in the master or in any forked worker,
+        reads the shared read-only plaintexts instead of decrypting.  The
+        segment is wiped once the last of those processes, the master
+        included, shuts down.
+        """
+        if self._shared is None:
+            envelopes = self.envelopes()
+            # Compressed ciphertext does not bound its plaintext, so decrypt
+            # into private locked buffers first and size the segment after.
+            results = cryptoHandler.decrypt_many(
+                list(envelopes.values()),
+                self._provider,
+                self._cache,
+                secureBuffer.SecureBuffer,
+            )
+            align = secureBuffer.SharedSegment._ALIGN
+            size = 0
+            for result in results:
+                if result.ok:
+                    size += -(-max(len(result.plaintext), 1) // align) * align
+            self.segment = secureBuffer.SharedSegment(size)
+            self._shared = {}
+            for name, result in zip(envelopes, results):
+                if result.ok:
+                    result = cryptoHandler.DecryptResult(self._move(result.plaintext))
+                self._shared[name] = result
+            self.segment.seal()
+        return self
+
+    def _move(self, staged):
+        try:
+            shared = self.segment.allocate(len(staged))
+            shared.writable()[:] = staged.view()
+            return shared
+        finally:
+            staged.close()
+
+    def _build(self, results):
+        ctx = SecureContext(self.envelopes(), self._provider, self._cache)
+        for seeded in (self._shared, results):
+            if seeded is not None:
+                ctx._store(list(seeded), list(seeded.values()))
+        return ctx
+
+    def _take(self):
+        # Prefetched plaintext is handed to the first context only; later
+        # contexts decrypt lazily, normally from the warm data key cache.
+        prefetched, self._prefetched = self._prefetched, None
+        return prefetched
+
+    def context(self, timeout=None):
+        """A :class:`SecureContext`, seeded with the prefetched plaintexts."""
+        prefetched = self._take()
+        return self._build(None if prefetched is None else prefetched.result(timeout))
+
+    async def acontext(self):
+        """Async :meth:`context`: awaits the prefetch without blocking the loop."""
+        import asyncio
+
+        prefetched = self._take()
+        results = None if prefetched is None else await asyncio.wrap_future(prefetched)
+        return self._build(results)
+
+    def _forget_prefetched(self):
+        prefetched = self._take()
+        if prefetched is not None:
+            for result in prefetched.result().values():
+                if result.ok:
+                    result.plaintext.close()
+
+
+# Prefetched plaintext must not be carried into a snapshot; the first
+# context after a restore decrypts lazily instead.
+_manifests = weakref.WeakSet()
+
+
+@cleanUp.register_snapshot_hook
+def _forget_prefetched():
+    for manifest in list(_manifests):
+        manifest._forget_prefetched()
+
+
+class BoundPool:
+    """A connection pool kept warm for as long as its secret is unchanged.
+
+    ``factory(var)`` builds the pool from a :class:`SecureVar`, reading the
+    credential through ``var.text()`` or ``var.reveal()``.  :meth:`get` hands
+    back the same pool on every warm invocation while the variable's
+    :attr:`~SecureVar.version` stays the same, so the TLS and auth handshakes
+    are paid once per container rather than once per call::
+
+        DB = BoundPool(lambda var: psycopg_pool.ConnectionPool(
+            DSN, kwargs={"password": var.text()}))
+
+        def handler(event, context):
+            with MANIFEST.context() as ctx, DB.get(ctx["db"]).connection() as conn:
+                ...
+
+    The pool is bound to that version through :func:`SDS.cleanUp.bind`:
+    :func:`~SDS.cleanUp.clean_up` leaves it alone, and it is closed with
+    ``close(pool)`` -- ``pool.close()`` by default -- when a new version
+    shows up, on :func:`~SDS.cleanUp.invalidate` or at shutdown.  Whatever
+    copy of the credential the driver keeps is only released by that close.
+    """
+
+    def __init__(self, factory, close=None):
+        self._factory = factory
+        self._close = close or (lambda pool: pool.close())
+        # Re-entrant: invalidating the old version calls back into _discard.
+        self._lock = threading.RLock()
+        self._pool = None
+        self._version = None
+
+    def get(self, var):
+        """The pool for ``var``'s current version, built on first use."""
+        version = var.version
+        with self._lock:
+            if self._pool is not None and self._version == version:
+                metrics.count("pool_reuses")
+                return self._pool
+            if self._pool is not None:
+                cleanUp.invalidate(self._version)
+            with metrics.timer("pool_connect"):
+                pool = self._factory(var)
+            self._pool, self._version = pool, version
+            cleanUp.bind(version, lambda: self._discard(pool))
+            return pool
+
+    def _discard(self, pool):
+        with self._lock:
+            if self._pool is pool:
+                self._pool = self._version = None
+        self._close(pool)
+
+    def invalidate(self):
+        """Close the current pool; the next :meth:`get` builds a new one."""
+        with self._lock:
+            version = self._version
+        if version is not None:
+            cleanUp.invalidate(version)
+
+
+def shielded(
+    secrets=(),
+    env=None,
+    provider=None,
+    cache=cryptoHandler.key_cache,
+    prefetch=True,
+    defer=False,
+):
+    """Decorator running a Lambda handler inside a :class:`SecureContext`.
+
+    ``secrets`` lists environment variables holding envelopes, each exposed
+    under its own name, or maps names to envelopes; ``env`` maps further
+    names to environment variables.  The handler is called as
+    ``handler(event, context, secrets)`` with a fresh context that is
+    closed, followed by :func:`~SDS.cleanUp.clean_up`, when it returns::
+
+        @shielded(secrets=["DB_PASSWORD"])
+        def handler(event, context, secrets):
+            password = secrets["DB_PASSWORD"].reveal()
+
+    Everything that does not change between invocations happens here, once:
+    the environment is read, envelopes are parsed (a malformed one fails
+    the import, not the first request), the crypto backend is loaded and,
+    with ``prefetch``, decryption starts in the background during INIT.  An
+    invocation then costs only building the context and the cleanup.  Under
+    SnapStart, :func:`~SDS.cleanUp.before_snapshot` wipes the prefetched
+    plaintext and cached keys while keeping everything else.  With
+    ``defer`` the cleanup runs after the response through
+    ``clean_up(defer=True)``; see :mod:`SDS.lambdaExtension`.
+    """
+    if isinstance(secrets, dict):
+        named, variables = dict(secrets), {}
+    else:
+        named, variables = {}, {name: name for name in secrets}
+    variables.update(env or {})
+    manifest = SecretManifest(named, variables, provider, cache)
+    for envelope in manifest.envelopes().values():
+        cryptoHandler.parse_envelope(envelope)
+    backends.default_algorithm()
+    cleanUp.install_snapshot_hooks()
+    if prefetch:
+        manifest.prefetch()
+    new_context = manifest.context
+    begin_invocation, clean_up = cleanUp.begin_invocation, cleanUp.clean_up
+    if defer:
+        cleanUp.expect_deferred()
+
+    def decorate(handler):
+        @functools.wraps(handler)
+        def wrapper(event, context):
+            # Key loads need not allocate, so wait for a deferred wipe here.
+            begin_invocation()
+            ctx = new_context()
+            try:
+                return handler(event, context, ctx)
+            finally:
+                ctx.close()
+                clean_up(defer, getattr(context, "aws_request_id", None))
+
+        wrapper.manifest = manifest
+        return wrapper
+
+    return decorate
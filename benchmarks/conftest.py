@@ -0,0 +1,17 @@
+import os
+
+import pytest
+
+from SDS.cryptoHandler import DataKeyCache, LocalKeyProvider
+
+KEY_ID = "alias/sds-bench"
+
+
+@pytest.fixture
+def provider():
+    return LocalKeyProvider({KEY_ID: os.urandom(32)})
+
+
+@pytest.fixture
+def cache():
+    return DataKeyCache()
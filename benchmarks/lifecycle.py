@@ -0,0 +1,308 @@
+"""Load-test harness replaying serverless lifecycles against SDS.
+
+The micro-benchmarks time single operations in a warm process; this
+replays what a fleet of Lambda containers actually does.  Every simulated
+container is a fresh interpreter that imports SDS, decorates a handler with
+:func:`~SDS.secureContext.shielded` (INIT), then serves a run of warm
+invocations with freeze/thaw cycles in between.  Containers run
+concurrently and share one simulated KMS account, which adds latency to
+every call and throttles above a request rate.
+
+Reported are p50/p95/p99 of SDS overhead per phase -- ``init``, the
+``cold`` first invocation, ``warm`` ones and the first after a thaw -- and
+KMS call counts, so the effect of the data key cache, prefetch and deferred
+cleanup can be checked under a given traffic shape::
+
+    python -m benchmarks.lifecycle --containers 16 --kms-latency 0.02 \\
+        --kms-rate 100 --freeze-seconds 600
+
+A freeze does not sleep: the container's wall clock is moved forward, which
+is what the key cache's expiry sees after a real thaw.
+"""
+
+import collections
+import math
+import os
+import random
+import threading
+import time
+
+KEY_ID = "alias/sds-load"
+
+PHASES = ("init", "cold", "warm", "thawed")
+
+
+class ThrottlingException(Exception):
+    """Raised by :class:`SimulatedKMS` for a call over the account's rate."""
+
+
+class TokenBucket:
+    """Account-wide KMS request quota, shared by every container process."""
+
+    def __init__(self, rate, context):
+        self.rate = rate
+        self._tokens = context.Value("d", rate, lock=False)
+        self._stamp = context.Value("d", time.monotonic(), lock=False)
+        self._lock = context.Lock()
+
+    def take(self):
+        with self._lock:
+            now = time.monotonic()
+            tokens = self._tokens.value + (now - self._stamp.value) * self.rate
+            self._stamp.value = now
+            self._tokens.value = min(tokens, self.rate)
+            if self._tokens.value < 1:
+                return False
+            self._tokens.value -= 1
+            return True
+
+
+class SimulatedKMS:
+    """boto3-shaped KMS client with injected latency and throttling.
+
+    Each call waits a log-normal delay with median ``latency``; one over
+    the account's rate raises :class:`ThrottlingException` at once, like the
+    client :class:`~SDS.cryptoHandler.KMSKeyProvider` builds, which leaves
+    retries to its :class:`~SDS.cryptoHandler.Backoff`.
+    """
+
+    def __init__(self, master_key, latency=0.0, jitter=0.5, bucket=None):
+        from SDS.cryptoHandler import LocalKeyProvider
+
+        self._keys = LocalKeyProvider({KEY_ID: master_key})
+        self.latency = latency
+        self.jitter = jitter
+        self.bucket = bucket
+        self.calls = collections.Counter()
+        self._lock = threading.Lock()
+
+    def _count(self, name):
+        with self._lock:
+            self.calls[name] += 1
+
+    def _call(self, operation, fn):
+        self._count(operation)
+        if self.latency:
+            time.sleep(self.latency * random.lognormvariate(0, self.jitter))
+        if self.bucket is not None and not self.bucket.take():
+            self._count("Throttled")
+            raise ThrottlingException(operation)
+        return fn()
+
+    def generate_data_key(self, KeyId, KeySpec):
+        data_key, wrapped_key = self._call(
+            "GenerateDataKey", lambda: self._keys.generate_data_key(KeyId)
+        )
+        return {"Plaintext": bytes(data_key), "CiphertextBlob": wrapped_key}
+
+    def decrypt(self, CiphertextBlob, KeyId):
+        data_key = self._call(
+            "Decrypt", lambda: self._keys.decrypt_data_key(KeyId, CiphertextBlob)
+        )
+        return {"Plaintext": bytes(data_key)}
+
+
+class _SandboxClock:
+    """Wall clock of a simulated sandbox; a freeze moves it forward at once."""
+
+    def __init__(self):
+        self.offset = 0.0
+        self._time = time.time
+        time.time = self.time
+
+    def time(self):
+        return self._time() + self.offset
+
+    def freeze(self, seconds):
+        self.offset += seconds
+
+
+class _LambdaContext:
+    def __init__(self, aws_request_id):
+        self.aws_request_id = aws_request_id
+
+
+class Scenario:
+    """Traffic shape and fault injection for one :func:`run`.
+
+    Each of ``containers`` serves ``invocations`` requests in a row and is
+    frozen for ``freeze_seconds`` after every ``freeze_every`` of them (0
+    never freezes).  ``kms_rate`` is the account's requests per second;
+    ``None`` never throttles.
+    """
+
+    def __init__(
+        self,
+        containers=4,
+        invocations=50,
+        secrets=8,
+        freeze_every=10,
+        freeze_seconds=60.0,
+        kms_latency=0.01,
+        kms_jitter=0.5,
+        kms_rate=None,
+        cache_ttl=300.0,
+        prefetch=True,
+        defer=False,
+    ):
+        self.containers = containers
+        self.invocations = invocations
+        self.secrets = secrets
+        self.freeze_every = freeze_every
+        self.freeze_seconds = freeze_seconds
+        self.kms_latency = kms_latency
+        self.kms_jitter = kms_jitter
+        self.kms_rate = kms_rate
+        self.cache_ttl = cache_ttl
+        self.prefetch = prefetch
+        self.defer = defer
+
+
+def _percentile(ordered, q):
+    return ordered[max(0, math.ceil(q / 100 * len(ordered)) - 1)]
+
+
+class Report:
+    """Overhead samples and KMS call counts gathered by :func:`run`."""
+
+    def __init__(self, scenario, samples, kms_calls, errors):
+        self.scenario = scenario
+        self.kms_calls = kms_calls
+        self.errors = errors
+        self._samples = samples
+
+    def samples(self, phase):
+        """Seconds spent in SDS for each occurrence of ``phase``."""
+        return self._samples.get(phase, [])
+
+    def percentiles(self, phase):
+        """``{"p50", "p95", "p99"}`` of ``phase`` in milliseconds."""
+        ordered = sorted(self.samples(phase))
+        if not ordered:
+            return {}
+        return {f"p{q}": _percentile(ordered, q) * 1000 for q in (50, 95, 99)}
+
+    def format(self):
+        lines = [f"{'phase':<8}{'n':>7}{'p50 ms':>10}{'p95 ms':>10}{'p99 ms':>10}"]
+        for phase in PHASES:
+            values = self.percentiles(phase)
+            if values:
+                lines.append(
+                    f"{phase:<8}{len(self.samples(phase)):>7}"
+                    + "".join(f"{values[q]:>10.3f}" for q in ("p50", "p95", "p99"))
+                )
+        calls = ", ".join(f"{op}={n}" for op, n in sorted(self.kms_calls.items()))
+        lines.append(f"KMS calls: {calls or 'none'}; failed invocations: {self.errors}")
+        return "\n".join(lines)
+
+
+def _seal_secrets(scenario, master_key):
+    from SDS.cryptoHandler import LocalKeyProvider, encrypt, to_text
+
+    provider = LocalKeyProvider({KEY_ID: master_key})
+    return {
+        f"secret{i}": to_text(encrypt(os.urandom(32), KEY_ID, provider, None))
+        for i in range(scenario.secrets)
+    }
+
+
+_bucket = None
+
+
+def _init_worker(bucket):
+    global _bucket
+    _bucket = bucket
+
+
+def _container(scenario, master_key, envelopes, index):
+    # Runs in its own interpreter: SDS is imported here so INIT includes it.
+    started = time.perf_counter()
+    clock = _SandboxClock()
+    os.environ["SDS_KEY_CACHE_TTL"] = str(scenario.cache_ttl)
+    from SDS import cleanUp, cryptoHandler
+    from SDS.secureContext import shielded
+
+    kms = SimulatedKMS(master_key, scenario.kms_latency, scenario.kms_jitter, _bucket)
+
+    @shielded(
+        envelopes,
+        provider=cryptoHandler.KMSKeyProvider(client=kms),
+        prefetch=scenario.prefetch,
+        defer=scenario.defer,
+    )
+    def handler(event, context, secrets):
+        for name in secrets:
+            secrets.reveal(name)
+
+    samples = collections.defaultdict(list)
+    samples["init"].append(time.perf_counter() - started)
+    errors = 0
+    phase = "cold"
+    for n in range(scenario.invocations):
+        if n and scenario.freeze_every and n % scenario.freeze_every == 0:
+            clock.freeze(scenario.freeze_seconds)
+            phase = "thawed"
+        context = _LambdaContext(f"{index}-{n}")
+        started = time.perf_counter()
+        try:
+            handler(None, context)
+        except ThrottlingException:
+            errors += 1
+        samples[phase].append(time.perf_counter() - started)
+        phase = "warm"
+        next_freezes = scenario.freeze_every and (n + 1) % scenario.freeze_every == 0
+        if scenario.defer and next_freezes:
+            # The extension keeps the sandbox thawed until the wipe is done.
+            cleanUp.wait_for_cleanup(context.aws_request_id)
+    return dict(samples), dict(kms.calls), errors
+
+
+def run(scenario=None, **options):
+    """Replay ``scenario`` (or a :class:`Scenario` built from ``options``)."""
+    import concurrent.futures
+    import functools
+    import multiprocessing
+
+    scenario = scenario or Scenario(**options)
+    master_key = os.urandom(32)
+    envelopes = _seal_secrets(scenario, master_key)
+    context = multiprocessing.get_context("spawn")
+    bucket = None
+    if scenario.kms_rate is not None:
+        bucket = TokenBucket(scenario.kms_rate, context)
+    samples = collections.defaultdict(list)
+    kms_calls = collections.Counter()
+    errors = 0
+    with concurrent.futures.ProcessPoolExecutor(
+        scenario.containers,
+        mp_context=context,
+        initializer=_init_worker,
+        initargs=(bucket,),
+        max_tasks_per_child=1,
+    ) as pool:
+        container = functools.partial(_container, scenario, master_key, envelopes)
+        for phases, calls, failed in pool.map(container, range(scenario.containers)):
+            for phase, values in phases.items():
+                samples[phase].extend(values)
+            kms_calls.update(calls)
+            errors += failed
+    return Report(scenario, dict(samples), dict(kms_calls), errors)
+
+
+def main(argv=None):
+    import argparse
+
+    parser = argparse.ArgumentParser(description=__doc__.split("\n\n")[0])
+    defaults = Scenario()
+    for name, value in vars(defaults).items():
+        flag = "--" + name.replace("_", "-")
+        if isinstance(value, bool):
+            parser.add_argument(flag, action=argparse.BooleanOptionalAction)
+        else:
+            parser.add_argument(flag, type=type(value) if value is not None else float)
+    parser.set_defaults(**vars(defaults))
+    print(run(Scenario(**vars(parser.parse_args(argv)))).format())
+
+
+if __name__ == "__main__":
+    main()
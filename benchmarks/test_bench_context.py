@@ -0,0 +1,78 @@
+import pytest
+
+from SDS import cleanUp, cryptoHandler, secureBuffer
+from SDS.secureContext import SecureContext, SecureVar, shielded
+
+from .conftest import KEY_ID
+
+SECRETS = 8
+
+
+def _envelopes(provider):
+    return {
+        f"secret{i}": cryptoHandler.encrypt(b"s" * 32, KEY_ID, provider, None)
+        for i in range(SECRETS)
+    }
+
+
+@pytest.mark.benchmark(group="context")
+def test_context_cold(benchmark, provider, cache):
+    envelopes = _envelopes(provider)
+
+    def cold():
+        cache.clear()
+        with SecureContext(envelopes, provider, cache) as ctx:
+            ctx.load()
+
+    benchmark(cold)
+
+
+@pytest.mark.benchmark(group="context")
+def test_context_warm(benchmark, provider, cache):
+    envelopes = _envelopes(provider)
+
+    def warm():
+        with SecureContext(envelopes, provider, cache) as ctx:
+            ctx.load()
+
+    warm()
+    benchmark(warm)
+
+
+@pytest.mark.benchmark(group="context")
+def test_shielded_handler_call(benchmark, provider, cache):
+    @shielded(_envelopes(provider), provider=provider, cache=cache, prefetch=False)
+    def handler(event, context, secrets):
+        return secrets.reveal("secret0")[0]
+
+    handler(None, None)
+    benchmark(handler, None, None)
+
+
+@pytest.mark.benchmark(group="secure-var")
+def test_secure_var_reveal(benchmark, provider, cache):
+    var = SecureVar.seal(b"s" * 32, KEY_ID, provider, cache)
+    var.reveal()
+    benchmark(var.reveal)
+
+
+@pytest.mark.benchmark(group="wipe")
+def test_wipe_bytearray_per_mb(benchmark):
+    buffer = bytearray(1 << 20)
+    benchmark.extra_info["bytes"] = len(buffer)
+    benchmark(cleanUp.wipe, buffer)
+
+
+@pytest.mark.benchmark(group="wipe")
+def test_arena_reset_per_mb(benchmark):
+    arena = secureBuffer.SecretArena(1 << 20)
+    slots = []
+
+    def fill():
+        slots.clear()
+        while arena.used < arena.capacity:
+            slots.append(arena.allocate(4096))
+            slots[-1].writable()[:] = b"s" * 4096
+
+    benchmark.extra_info["bytes"] = arena.capacity
+    benchmark.pedantic(arena.reset, setup=fill, rounds=20)
@@ -0,0 +1,113 @@
+import io
+import os
+
+import pytest
+
+from SDS import backends, cryptoHandler
+
+from .conftest import KEY_ID
+
+PAYLOAD_SIZES = [64, 1024, 16 * 1024, 64 * 1024]
+
+
+@pytest.mark.benchmark(group="encrypt")
+@pytest.mark.parametrize("size", PAYLOAD_SIZES)
+def test_encrypt(benchmark, provider, cache, size):
+    payload = os.urandom(size)
+    benchmark.extra_info["bytes"] = size
+    benchmark(cryptoHandler.encrypt, payload, KEY_ID, provider, cache)
+
+
+@pytest.mark.benchmark(group="decrypt")
+@pytest.mark.parametrize("size", PAYLOAD_SIZES)
+def test_decrypt(benchmark, provider, cache, size):
+    envelope = cryptoHandler.encrypt(os.urandom(size), KEY_ID, provider, cache)
+    benchmark.extra_info["bytes"] = size
+    benchmark(cryptoHandler.decrypt, envelope, provider, cache)
+
+
+@pytest.mark.benchmark(group="decrypt-many")
+def test_decrypt_many(benchmark, provider, cache):
+    envelopes = [
+        cryptoHandler.encrypt(os.urandom(32), KEY_ID, provider, None) for _ in range(16)
+    ]
+
+    def cold_batch():
+        cache.clear()
+        return cryptoHandler.decrypt_many(envelopes, provider, cache)
+
+    benchmark(cold_batch)
+
+
+@pytest.mark.benchmark(group="stream")
+def test_stream_round_trip(benchmark, provider, cache):
+    payload = os.urandom(256 * 1024)
+    benchmark.extra_info["bytes"] = len(payload)
+
+    def round_trip():
+        sealed = io.BytesIO()
+        source = io.BytesIO(payload)
+        cryptoHandler.encrypt_stream(source, sealed, KEY_ID, provider, cache)
+        sealed.seek(0)
+        cryptoHandler.decrypt_stream(sealed, io.BytesIO(), provider, cache)
+
+    benchmark.pedantic(round_trip, rounds=3)
+
+
+@pytest.mark.benchmark(group="aead")
+@pytest.mark.parametrize("algorithm", backends.ALGORITHMS)
+@pytest.mark.parametrize("name", backends.available_backends())
+def test_aead_seal(benchmark, name, algorithm):
+    backend = backends.load_backend(name)
+    if algorithm not in backend.algorithms:
+        pytest.skip(f"{name} does not implement {algorithm}")
+    cipher = backend.aead(algorithm, os.urandom(32))
+    payload = os.urandom(16 * 1024)
+    benchmark.extra_info.update(bytes=len(payload), **backends.describe())
+    benchmark(cipher.seal, os.urandom(12), payload)
+
+
+@pytest.mark.benchmark(group="fields")
+def test_field_schema_encrypt(benchmark, provider, cache):
+    schema = cryptoHandler.FieldSchema(["user.email", "user.ssn", "items[*].card"])
+    items = [{"card": "4111111111111111", "sku": f"sku-{i}"} for i in range(8)]
+    padding = {f"attr{i}": "x" * 64 for i in range(500)}
+
+    def encrypt_event():
+        event = {"user": {"email": "a@example.com", "ssn": "123"}, "items": items}
+        event["items"] = [dict(item) for item in items]
+        event.update(padding)
+        return schema.encrypt(event, KEY_ID, provider, cache)
+
+    benchmark(encrypt_event)
+
+
+@pytest.mark.benchmark(group="batch")
+def test_encrypt_batch(benchmark, provider, cache):
+    records = [os.urandom(256) for _ in range(1000)]
+    benchmark.extra_info["records"] = len(records)
+    benchmark(cryptoHandler.encrypt_batch, records, KEY_ID, provider, cache)
+
+
+@pytest.mark.benchmark(group="batch")
+def test_decrypt_batch(benchmark, provider, cache):
+    records = [os.urandom(256) for _ in range(1000)]
+    results = cryptoHandler.encrypt_batch(records, KEY_ID, provider, cache)
+    envelopes = [result.envelope for result in results]
+    benchmark.extra_info["records"] = len(records)
+    benchmark(cryptoHandler.decrypt_batch, envelopes, provider, cache)
+
+
+@pytest.mark.benchmark(group="batch")
+def test_encrypt_column(benchmark, provider, cache):
+    column = [os.urandom(256) for _ in range(1000)]
+    benchmark.extra_info["records"] = len(column)
+    benchmark(cryptoHandler.encrypt_column, column, KEY_ID, provider, cache)
+
+
+@pytest.mark.benchmark(group="batch")
+def test_decrypt_column(benchmark, provider, cache):
+    column = [os.urandom(256) for _ in range(1000)]
+    sealed = cryptoHandler.encrypt_column(column, KEY_ID, provider, cache)
+    benchmark.extra_info["records"] = len(column)
+    benchmark(cryptoHandler.decrypt_column, sealed, provider, cache)
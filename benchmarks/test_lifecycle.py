@@ -0,0 +1,36 @@
+from . import lifecycle
+
+
+def test_warm_invocations_reuse_cached_data_keys():
+    report = lifecycle.run(
+        containers=2, invocations=6, secrets=3, freeze_every=0, kms_latency=0.0
+    )
+    assert report.errors == 0
+    assert report.kms_calls == {"Decrypt": 2 * 3}
+    assert len(report.samples("init")) == 2
+    assert len(report.samples("warm")) == 2 * 5
+    assert set(report.percentiles("warm")) == {"p50", "p95", "p99"}
+
+
+def test_thaw_past_the_cache_ttl_fetches_again():
+    report = lifecycle.run(
+        containers=2,
+        invocations=6,
+        secrets=3,
+        freeze_every=3,
+        freeze_seconds=61.0,
+        cache_ttl=60.0,
+        kms_latency=0.0,
+        defer=True,
+    )
+    assert report.errors == 0
+    assert len(report.samples("thawed")) == 2
+    assert report.kms_calls == {"Decrypt": 2 * 3 * 2}
+
+
+def test_throttling_is_retried_and_counted():
+    report = lifecycle.run(
+        containers=2, invocations=2, secrets=4, kms_latency=0.0, kms_rate=2.0
+    )
+    assert report.kms_calls["Throttled"] > 0
+    assert "KMS calls:" in report.format()
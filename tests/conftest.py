@@ -0,0 +1,29 @@
+import os
+
+import pytest
+
+from SDS.cryptoHandler import LocalKeyProvider
+
+
+class CountingProvider(LocalKeyProvider):
+    """Local master key that counts round-trips, standing in for KMS."""
+
+    key_id = "alias/sds-test"
+
+    def __init__(self):
+        super().__init__({self.key_id: os.urandom(32)})
+        self.generated = 0
+        self.decrypted = 0
+
+    def generate_data_key(self, key_id):
+        self.generated += 1
+        return super().generate_data_key(key_id)
+
+    def decrypt_data_key(self, key_id, wrapped_key):
+        self.decrypted += 1
+        return super().decrypt_data_key(key_id, wrapped_key)
+
+
+@pytest.fixture
+def provider():
+    return CountingProvider()
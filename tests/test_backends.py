@@ -0,0 +1,92 @@
+import os
+
+import pytest
+
+from SDS import backends, cryptoHandler
+from SDS.backends import CHACHA20_POLY1305, DecryptionError
+
+
+def test_openssl_matches_pure_python():
+    if "openssl" not in backends.available_backends():
+        pytest.skip("libcrypto not available")
+    native = backends.load_backend("openssl")
+    python = backends.load_backend("python")
+    for size in (0, 1, 63, 64, 65, 1000):
+        key, nonce, plaintext = os.urandom(32), os.urandom(12), os.urandom(size)
+        aad = os.urandom(size % 20)
+        sealed = native.aead(CHACHA20_POLY1305, key).seal(nonce, plaintext, aad)
+        assert python.aead(CHACHA20_POLY1305, key).seal(nonce, plaintext, aad) == sealed
+        out = bytearray(size)
+        python.aead(CHACHA20_POLY1305, key).open(nonce, sealed, aad, memoryview(out))
+        assert out == plaintext
+
+
+@pytest.mark.parametrize("algorithm", backends.ALGORITHMS)
+def test_aead_round_trip_and_tamper(algorithm):
+    key, nonce = os.urandom(32), os.urandom(12)
+    sealed = cryptoHandler.aead_seal(key, nonce, b"hunter2", b"aad", algorithm)
+    opened = cryptoHandler.aead_open(key, nonce, sealed, b"aad", algorithm=algorithm)
+    assert opened == b"hunter2"
+    forged = bytes([sealed[0] ^ 1]) + sealed[1:]
+    with pytest.raises(DecryptionError):
+        cryptoHandler.aead_open(key, nonce, forged, b"aad", algorithm=algorithm)
+
+
+@pytest.mark.parametrize("name", backends.available_backends())
+def test_row_loops_match_single_calls(name):
+    aead = backends.load_backend(name).aead(CHACHA20_POLY1305, os.urandom(32))
+    rows = [os.urandom(size) for size in (0, 5, 64, 300)]
+    values, starts, ends = b"".join(rows), [], []
+    for row in rows:
+        starts.append(sum(map(len, rows[: len(starts)])))
+        ends.append(starts[-1] + len(row))
+    nonces = [os.urandom(12) for _ in rows]
+    sealed = [n + aead.seal(n, row, b"aad") for n, row in zip(nonces, rows)]
+    positions = [sum(map(len, sealed[:i])) for i in range(len(rows))]
+    out = bytearray(b"".join(n + bytes(len(s) - 12) for n, s in zip(nonces, sealed)))
+    aead.seal_rows(range(len(rows)), values, starts, ends, b"aad", out, positions)
+    assert out == b"".join(sealed)
+    opened = bytearray(len(values))
+    sealed_ends = positions[1:] + [len(out)]
+    args = (out, positions, sealed_ends, b"aad", opened, starts)
+    assert aead.open_rows(range(len(rows)), *args) is None
+    assert opened == values
+    out[positions[2] + 20] ^= 1
+    assert aead.open_rows(range(len(rows)), *args) == 2
+
+
+@pytest.mark.parametrize("algorithm", backends.ALGORITHMS)
+def test_envelopes_record_their_algorithm(provider, monkeypatch, algorithm):
+    monkeypatch.setenv("SDS_ALGORITHM", algorithm)
+    envelope = cryptoHandler.encrypt(b"hunter2", provider.key_id, provider, cache=None)
+    assert cryptoHandler.parse_envelope(envelope)["alg"] == algorithm
+    monkeypatch.delenv("SDS_ALGORITHM")
+    assert cryptoHandler.decrypt(envelope, provider, cache=None) == b"hunter2"
+
+
+def test_algorithm_pin_is_validated(monkeypatch):
+    monkeypatch.setenv("SDS_ALGORITHM", "aes-256-gcm")
+    with pytest.raises(ValueError, match="AES_256_GCM"):
+        backends.default_algorithm()
+
+def test_backend_override(provider, monkeypatch):
+    monkeypatch.setattr(backends, "_backend", None)
+    monkeypatch.delenv("SDS_ALGORITHM", raising=False)
+    backends.set_backend("python")
+    assert backends.describe()["backend"] == "python"
+    assert backends.default_algorithm() == CHACHA20_POLY1305
+    envelope = cryptoHandler.encrypt(b"hunter2", provider.key_id, provider, cache=None)
+    assert cryptoHandler.decrypt(envelope, provider, cache=None) == b"hunter2"
+
+
+def test_cpu_feature_parsing():
+    x86 = "processor\t: 0\nflags\t\t: fpu sse2 aes pclmulqdq avx2 vaes vpclmulqdq\n"
+    assert backends._parse_cpu_features(x86, "linux", "x86_64") == {
+        "aes",
+        "clmul",
+        "vaes",
+        "simd",
+    }
+    graviton = "Features\t: fp asimd aes pmull sha1 sha2\n"
+    assert {"aes", "clmul"} <= backends._parse_cpu_features(graviton, "linux", "arm")
+    assert not backends._parse_cpu_features("flags\t: fpu sse2\n", "linux", "x86_64")
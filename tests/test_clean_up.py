@@ -0,0 +1,133 @@
+import sys
+import threading
+import types
+
+import pytest
+
+from SDS import cleanUp, metrics, secureBuffer
+
+
+def test_wipe_zeroes_in_place():
+    secret = bytearray(b"hunter2")
+    view = memoryview(secret)
+    cleanUp.wipe(secret)
+    assert view.tobytes() == bytes(7)
+
+
+def test_wipe_rejects_read_only_buffers():
+    with pytest.raises(TypeError):
+        cleanUp.wipe(b"hunter2")
+
+
+def test_failing_hook_does_not_stop_cleanup(monkeypatch):
+    calls = []
+    monkeypatch.setattr(cleanUp, "_invocation_hooks", [])
+
+    def broken():
+        raise RuntimeError("boom")
+
+    cleanUp.register_invocation_hook(broken)
+    cleanUp.register_invocation_hook(lambda: calls.append("ran"))
+    cleanUp.clean_up()
+    assert calls == ["ran"]
+
+
+def test_deferred_cleanup_gates_next_invocation(monkeypatch):
+    release = threading.Event()
+    monkeypatch.setattr(cleanUp, "_invocation_hooks", [])
+    cleanUp.register_invocation_hook(release.wait)
+    cleanUp.clean_up(defer=True, request_id="req-1")
+    with pytest.raises(TimeoutError):
+        cleanUp.begin_invocation(timeout=0.01)
+    assert not cleanUp.wait_for_cleanup("req-1", timeout=0)
+    release.set()
+    cleanUp.begin_invocation(timeout=5)
+    assert cleanUp.wait_for_cleanup("req-1", timeout=0)
+
+
+def test_tracked_objects_are_closed_once(monkeypatch):
+    secureBuffer.default_arena()  # registers its reset hook for good
+    monkeypatch.setattr(cleanUp, "_invocation_hooks", [])
+    large = secureBuffer.allocate(64 * 1024)
+    large.writable()[:4] = b"key!"
+    generation = cleanUp.generation
+    cleanUp.clean_up()
+    assert large.closed
+    assert cleanUp.generation == generation + 1
+    survivor = cleanUp.track(secureBuffer.SecureBuffer(16))
+    assert not survivor.closed
+    cleanUp.clean_up()
+    assert survivor.closed
+
+
+def test_snapshot_hooks_register_with_the_runtime(monkeypatch):
+    registered = {}
+    runtime = types.SimpleNamespace(
+        register_before_snapshot=lambda hook: registered.setdefault("before", hook),
+        register_after_restore=lambda hook: registered.setdefault("after", hook),
+    )
+    monkeypatch.setattr(cleanUp, "_snapshot_installed", False)
+    monkeypatch.setitem(sys.modules, "snapshot_restore_py", None)
+    assert not cleanUp.install_snapshot_hooks()
+    monkeypatch.setitem(sys.modules, "snapshot_restore_py", runtime)
+    assert cleanUp.install_snapshot_hooks() and cleanUp.install_snapshot_hooks()
+    assert registered == {
+        "before": cleanUp.before_snapshot,
+        "after": cleanUp.after_restore,
+    }
+
+
+def test_snapshot_wipes_tracked_secrets_and_runs_hooks(monkeypatch):
+    calls = []
+    for name in ("_invocation_hooks", "_snapshot_hooks", "_restore_hooks"):
+        monkeypatch.setattr(cleanUp, name, [])
+    cleanUp.register_snapshot_hook(lambda: calls.append("snapshot"))
+    cleanUp.register_restore_hook(lambda: calls.append("restore"))
+    secret = cleanUp.track(secureBuffer.SecureBuffer(16))
+    cleanUp.before_snapshot()
+    assert secret.closed and calls == ["snapshot"]
+    cleanUp.after_restore()
+    assert calls == ["snapshot", "restore"]
+
+
+@pytest.fixture
+def sampled(monkeypatch):
+    emitted = {}
+    monkeypatch.setattr(metrics, "emit", lambda: emitted.update(metrics.snapshot()))
+    monkeypatch.setattr(cleanUp, "verify_rate", 1.0)
+    metrics.enable("emf")
+    yield emitted
+    metrics.disable()
+
+
+def test_sampled_cleanup_scans_what_is_still_resident(sampled):
+    arena = secureBuffer.default_arena()
+    small, large = secureBuffer.allocate(64), secureBuffer.allocate(64 * 1024)
+    small.writable()[:] = b"k" * 64
+    large.writable()[:4] = b"key!"
+    cleanUp.clean_up()
+    assert small.closed and large.closed
+    assert sampled["wipe_checks"] == 1 and "wipe_failures" not in sampled
+    assert sampled["wipe_checked_bytes"] >= arena.capacity
+
+
+class _StuckBuffer(secureBuffer.SecureBuffer):
+    def close(self):
+        raise RuntimeError("stuck")
+
+
+def test_secret_left_behind_is_a_wipe_failure(sampled):
+    stuck = cleanUp.track(_StuckBuffer(32))
+    stuck.writable()[:4] = b"key!"
+    try:
+        cleanUp.clean_up()
+    finally:
+        secureBuffer.SecureBuffer.close(stuck)
+    assert sampled["wipe_failures"] == 1
+
+
+def test_verify_wiped_finds_residue_anywhere():
+    buffer = bytearray(200 * 1024)
+    assert cleanUp.verify_wiped(buffer)
+    buffer[-1] = 1
+    assert not cleanUp.verify_wiped(buffer)
@@ -0,0 +1,600 @@
+import asyncio
+import base64
+import io
+import json
+import os
+import threading
+import time
+import zlib
+
+import pytest
+
+from SDS import cleanUp, cryptoHandler
+from SDS.cryptoHandler import DataKeyCache, DecryptionError
+
+
+def test_round_trip(provider):
+    envelope = cryptoHandler.encrypt(b"hunter2", provider.key_id, provider, cache=None)
+    assert b"hunter2" not in envelope
+    assert cryptoHandler.decrypt(envelope, provider, cache=None) == b"hunter2"
+
+
+def test_tampered_envelope_is_rejected(provider):
+    envelope = cryptoHandler.encrypt(b"hunter2", provider.key_id, provider, cache=None)
+    forged = bytearray(envelope)
+    forged[-len(b"hunter2") - cryptoHandler.TAG_SIZE] ^= 1
+    with pytest.raises(DecryptionError):
+        cryptoHandler.decrypt(forged, provider, cache=None)
+
+
+def test_warm_decrypt_skips_key_provider(provider):
+    envelope = cryptoHandler.encrypt(b"hunter2", provider.key_id, provider, cache=None)
+    cache = DataKeyCache()
+    for _ in range(3):
+        assert cryptoHandler.decrypt(envelope, provider, cache) == b"hunter2"
+    assert provider.decrypted == 1
+
+
+def test_encryption_reuses_cached_data_key(provider):
+    cache = DataKeyCache(max_messages=2)
+    envelopes = [
+        cryptoHandler.encrypt(b"x", provider.key_id, provider, cache) for _ in range(3)
+    ]
+    assert provider.generated == 2
+    assert [cryptoHandler.decrypt(e, provider, cache) for e in envelopes] == [b"x"] * 3
+    assert provider.decrypted == 0
+
+
+def test_expired_keys_are_purged(provider, monkeypatch):
+    envelope = cryptoHandler.encrypt(b"hunter2", provider.key_id, provider, cache=None)
+    cache = DataKeyCache(ttl=60)
+    cryptoHandler.decrypt(envelope, provider, cache)
+    now = cryptoHandler.time.time()
+    monkeypatch.setattr(cryptoHandler.time, "time", lambda: now + 61)
+    assert cache.purge_expired() == 1
+    assert len(cache) == 0
+    cryptoHandler.decrypt(envelope, provider, cache)
+    assert provider.decrypted == 2
+
+
+def test_expired_keys_left_in_the_cache_are_residue(provider, monkeypatch):
+    cache = DataKeyCache(ttl=60)
+    cache.put(provider.key_id, b"wrapped", bytearray(b"k" * 32))
+    cache.purge_expired()
+    assert cache.residue() == []
+    monkeypatch.setattr(cache, "_drop", lambda key: None)
+    monkeypatch.setattr(time, "time", lambda: 1e12)
+    cache.purge_expired()
+    (sealed,) = cache.residue()
+    assert not cleanUp.verify_wiped(sealed)
+
+
+def test_shutdown_clears_module_cache(provider):
+    cryptoHandler.encrypt(b"hunter2", provider.key_id, provider)
+    assert len(cryptoHandler.key_cache) > 0
+    cleanUp.shutdown()
+    assert len(cryptoHandler.key_cache) == 0
+
+
+def test_decrypt_many_unwraps_each_data_key_once(provider):
+    cache = cryptoHandler.DataKeyCache()
+    envelopes = [
+        cryptoHandler.encrypt(bytes([i]), provider.key_id, provider, cache)
+        for i in range(10)
+    ]
+    envelopes += [cryptoHandler.encrypt(b"other", provider.key_id, provider, None)]
+    results = cryptoHandler.decrypt_many(envelopes, provider, cache=None)
+    expected = [bytes([i]) for i in range(10)] + [b"other"]
+    assert [result.plaintext for result in results] == expected
+    assert provider.decrypted == 2
+
+
+def test_decrypt_many_reports_per_item_errors(provider):
+    good = cryptoHandler.encrypt(b"ok", provider.key_id, provider, cache=None)
+    results = cryptoHandler.decrypt_many(["not json", good], provider, cache=None)
+    assert isinstance(results[0].error, DecryptionError)
+    assert results[1].ok and results[1].plaintext == b"ok"
+
+
+def test_decrypt_many_reports_allocation_failures_per_item(provider):
+    envelopes = [
+        cryptoHandler.encrypt(plaintext, provider.key_id, provider, cache=None)
+        for plaintext in (b"short", b"much too long", b"tiny")
+    ]
+
+    def alloc(size):
+        if size > 8:
+            raise MemoryError("no room")
+        return bytearray(size)
+
+    results = cryptoHandler.decrypt_many(envelopes, provider, None, alloc)
+    assert isinstance(results[1].error, MemoryError)
+    assert [results[0].plaintext, results[2].plaintext] == [b"short", b"tiny"]
+
+
+def test_envelope_encodings_round_trip(provider):
+    envelope = cryptoHandler.encrypt(b"hunter2", provider.key_id, provider, None)
+    text = cryptoHandler.encrypt(b"hunter2", provider.key_id, provider, None, True)
+    assert isinstance(text, str) and text.isascii()
+    assert len(envelope) < len(text) < 2 * len(envelope)
+    record = memoryview(b"prefix" + envelope + b"suffix")[6:-6]
+    fields = cryptoHandler.parse_envelope(record)
+    assert fields["ct"].obj is record.obj and fields["kid"] == provider.key_id
+    legacy = json.dumps(
+        {
+            "v": 1,
+            "alg": fields["alg"],
+            "kid": fields["kid"],
+            "key": base64.b64encode(fields["key"]).decode(),
+            "salt": base64.b64encode(fields["salt"]).decode(),
+            "nonce": base64.b64encode(fields["nonce"]).decode(),
+            "ct": base64.b64encode(fields["ct"]).decode(),
+        }
+    )
+    for encoded in (record, text, legacy, legacy.encode()):
+        assert cryptoHandler.decrypt(encoded, provider, cache=None) == b"hunter2"
+    with pytest.raises(DecryptionError):
+        cryptoHandler.parse_envelope(envelope[:20])
+
+
+def _stream_round_trip(provider, payload, chunk_size, compress=None):
+    sealed = io.BytesIO()
+    compress = compress and cryptoHandler.Compression(compress)
+    cryptoHandler.encrypt_stream(
+        io.BytesIO(payload),
+        sealed,
+        provider.key_id,
+        provider,
+        None,
+        chunk_size,
+        compress,
+    )
+    opened = io.BytesIO()
+    source = io.BytesIO(sealed.getvalue())
+    cryptoHandler.decrypt_stream(source, opened, provider, None, read_size=7)
+    return sealed.getvalue(), opened.getvalue()
+
+
+def test_stream_round_trip_across_chunk_boundaries(provider):
+    for size in (0, 1, 63, 64, 65, 640):
+        payload = os.urandom(size)
+        sealed, opened = _stream_round_trip(provider, payload, chunk_size=64)
+        assert opened == payload
+        assert len(sealed) < size + 16 * (size // 64 + 1) + 128
+
+
+def test_truncated_stream_is_rejected(provider):
+    sealed, _ = _stream_round_trip(provider, os.urandom(256), chunk_size=64)
+    frame = 64 + cryptoHandler.TAG_SIZE
+    for cut in (len(sealed) - cryptoHandler.TAG_SIZE, len(sealed) - frame):
+        with pytest.raises(DecryptionError):
+            cryptoHandler.decrypt_stream(
+                io.BytesIO(sealed[:cut]), io.BytesIO(), provider, None
+            )
+
+
+def test_async_stream_round_trip(provider):
+    payload = os.urandom(300)
+
+    async def chunks(data, size):
+        for offset in range(0, len(data), size):
+            yield data[offset : offset + size]
+
+    async def run():
+        encrypted = cryptoHandler.aencrypt_iter(
+            chunks(payload, 50), provider.key_id, provider, None, 64
+        )
+        sealed = b"".join([piece async for piece in encrypted])
+        opened = cryptoHandler.adecrypt_iter(chunks(sealed, 33), provider, None)
+        return b"".join([bytes(piece) async for piece in opened])
+
+    assert asyncio.run(run()) == payload
+
+
+def test_async_round_trip_and_batch(provider):
+    async def run():
+        envelope = await cryptoHandler.aencrypt(b"a" * 20000, provider.key_id, provider)
+        other = cryptoHandler.encrypt(b"b", provider.key_id, provider, cache=None)
+        single = await cryptoHandler.adecrypt(envelope, provider, cache=None)
+        envelopes = [envelope, other, "x"]
+        batch = await cryptoHandler.adecrypt_many(envelopes, provider, cache=None)
+        return single, batch
+
+    single, batch = asyncio.run(run())
+    assert single == b"a" * 20000
+    assert [result.plaintext for result in batch[:2]] == [b"a" * 20000, b"b"]
+    assert isinstance(batch[2].error, DecryptionError)
+
+
+def test_default_async_provider_runs_off_the_event_loop():
+    calls = []
+
+    class BlockingProvider(cryptoHandler.KeyProvider):
+        def generate_data_key(self, key_id):
+            calls.append(threading.current_thread().name)
+            return bytearray(32), b"wrapped"
+
+    asyncio.run(BlockingProvider().agenerate_data_key("k"))
+    assert calls[0].startswith("sds-key-fetch")
+
+
+def test_concurrent_misses_share_one_key_fetch(provider):
+    envelope = cryptoHandler.encrypt(b"hunter2", provider.key_id, provider, cache=None)
+    fetching, release = threading.Event(), threading.Event()
+    unwrap = provider.decrypt_data_key
+
+    def slow_unwrap(key_id, wrapped_key):
+        fetching.set()
+        release.wait(5)
+        return unwrap(key_id, wrapped_key)
+
+    provider.decrypt_data_key = slow_unwrap
+    results = []
+
+    def open_envelope():
+        results.append(cryptoHandler.decrypt(envelope, provider, cache=None))
+
+    threads = [threading.Thread(target=open_envelope) for _ in range(4)]
+    threads[0].start()
+    fetching.wait(5)
+    for thread in threads[1:]:
+        thread.start()
+    time.sleep(0.1)
+    release.set()
+    for thread in threads:
+        thread.join()
+    assert results == [b"hunter2"] * 4
+    assert provider.decrypted == 1
+
+
+def test_blocking_unwrap_on_the_loop_does_not_join_its_async_flight(provider):
+    envelope = cryptoHandler.encrypt(b"hunter2", provider.key_id, provider, cache=None)
+    unwrap = provider.decrypt_data_key
+
+    async def slow_unwrap(key_id, wrapped_key):
+        await asyncio.sleep(0.05)
+        return unwrap(key_id, wrapped_key)
+
+    provider.adecrypt_data_key = slow_unwrap
+
+    async def handler():
+        leader = asyncio.ensure_future(
+            cryptoHandler.adecrypt(envelope, provider, cache=None)
+        )
+        await asyncio.sleep(0)
+        blocking = cryptoHandler.decrypt(envelope, provider, cache=None)
+        return blocking, await leader
+
+    assert asyncio.run(asyncio.wait_for(handler(), 5)) == (b"hunter2", b"hunter2")
+    assert provider.decrypted == 2
+
+
+def test_stranded_waiter_fetches_on_its_own(provider, monkeypatch):
+    envelope = cryptoHandler.encrypt(b"hunter2", provider.key_id, provider, cache=None)
+    monkeypatch.setattr(cryptoHandler, "FLIGHT_TIMEOUT", 0.05)
+    fetching, release = threading.Event(), threading.Event()
+    unwrap = provider.decrypt_data_key
+
+    def stuck_unwrap(key_id, wrapped_key):
+        if not fetching.is_set():
+            fetching.set()
+            release.wait(5)
+        return unwrap(key_id, wrapped_key)
+
+    provider.decrypt_data_key = stuck_unwrap
+    leader = threading.Thread(
+        target=cryptoHandler.decrypt, args=(envelope, provider, None)
+    )
+    leader.start()
+    fetching.wait(5)
+    assert cryptoHandler.decrypt(envelope, provider, cache=None) == b"hunter2"
+    release.set()
+    leader.join()
+    assert provider.decrypted == 2
+
+
+def test_new_leader_rechecks_the_cache(provider, monkeypatch):
+    envelope = cryptoHandler.encrypt(b"hunter2", provider.key_id, provider, cache=None)
+    cache = DataKeyCache()
+    lookup = cryptoHandler._cache_lookup
+
+    def missed_then_landed(cache, key_id, wrapped_key):
+        # Another caller's flight lands right after this caller's miss.
+        data_key = lookup(cache, key_id, wrapped_key)
+        cache.put(key_id, wrapped_key, provider.decrypt_data_key(key_id, wrapped_key))
+        return data_key
+
+    monkeypatch.setattr(cryptoHandler, "_cache_lookup", missed_then_landed)
+    assert cryptoHandler.decrypt(envelope, provider, cache) == b"hunter2"
+    assert provider.decrypted == 1
+
+
+MRK_ARN = "arn:aws:kms:us-east-1:111122223333:key/mrk-1234abcd"
+
+
+class Throttled(Exception):
+    response = {"Error": {"Code": "ThrottlingException"}}
+
+
+class FakeKMS:
+    """boto3-shaped KMS client over a local multi-Region key."""
+
+    def __init__(self, keys, throttles=0):
+        self.keys = keys
+        self.throttles = throttles
+        self.key_ids = []
+
+    def _call(self, key_id):
+        self.key_ids.append(key_id)
+        if self.throttles:
+            self.throttles -= 1
+            raise Throttled()
+
+    def generate_data_key(self, KeyId, KeySpec):
+        self._call(KeyId)
+        data_key, wrapped_key = self.keys.generate_data_key("mrk")
+        return {"Plaintext": bytes(data_key), "CiphertextBlob": wrapped_key}
+
+    def decrypt(self, CiphertextBlob, KeyId):
+        self._call(KeyId)
+        return {"Plaintext": bytes(self.keys.decrypt_data_key("mrk", CiphertextBlob))}
+
+
+def test_throttled_key_fetches_back_off_and_retry():
+    kms = FakeKMS(cryptoHandler.LocalKeyProvider({"mrk": os.urandom(32)}), 2)
+    provider = cryptoHandler.KMSKeyProvider(kms, backoff=cryptoHandler.Backoff(base=0))
+    envelope = cryptoHandler.encrypt(b"hunter2", MRK_ARN, provider, cache=None)
+    assert kms.key_ids == [MRK_ARN] * 3
+    assert provider.backoff.throttle_rate > 0
+    assert cryptoHandler.decrypt(envelope, provider, cache=None) == b"hunter2"
+
+
+def test_exhausted_retries_fail_over_to_the_replica_region():
+    keys = cryptoHandler.LocalKeyProvider({"mrk": os.urandom(32)})
+    primary, replica = FakeKMS(keys, throttles=100), FakeKMS(keys)
+    provider = cryptoHandler.KMSKeyProvider(
+        primary,
+        backoff=cryptoHandler.Backoff(attempts=2, base=0),
+        replicas={"us-west-2": replica},
+    )
+    envelope = cryptoHandler.encrypt(b"hunter2", MRK_ARN, provider, cache=None)
+    assert cryptoHandler.decrypt(envelope, provider, cache=None) == b"hunter2"
+    assert primary.key_ids == [MRK_ARN] * 4
+    assert replica.key_ids == [MRK_ARN.replace("us-east-1", "us-west-2")] * 2
+
+
+def test_field_schema_shields_only_listed_fields(provider):
+    schema = cryptoHandler.FieldSchema(
+        ["customer.email", "customer.age", "orders[*].card", "missing.field"]
+    )
+    document = {
+        "customer": {"email": "a@example.com", "age": 41, "name": "Ann"},
+        "orders": [{"card": "4111", "sku": "x"}, {"card": "5500", "sku": "y"}],
+    }
+    original = json.loads(json.dumps(document))
+    schema.encrypt(document, provider.key_id, provider, cache=None)
+    assert document["customer"]["name"] == "Ann"
+    assert document["orders"][1]["sku"] == "y"
+    assert "4111" not in json.dumps(document)
+    assert provider.generated == 1
+    assert schema.decrypt(document, provider, cache=None) == original
+    assert provider.decrypted == 1
+    with pytest.raises(ValueError):
+        cryptoHandler.FieldSchema(["customer", "customer.email"])
+
+
+def test_deterministic_key_is_stable_across_instances(provider):
+    wrapped = cryptoHandler.DeterministicKey.generate(provider.key_id, provider)
+    first = cryptoHandler.DeterministicKey(provider.key_id, wrapped, provider, None)
+    second = cryptoHandler.DeterministicKey(provider.key_id, wrapped, provider, None)
+    assert first.token("a@example.com") == second.token(b"a@example.com")
+    assert first.token("a@example.com") != first.token("b@example.com")
+    sealed = first.encrypt("a@example.com")
+    assert second.encrypt("a@example.com") == sealed
+    assert second.decrypt(sealed) == b"a@example.com"
+    with pytest.raises(DecryptionError):
+        second.decrypt(sealed, aad=b"other-table")
+
+
+def test_column_round_trip_shares_one_key(provider):
+    column = [b"4111-%04d" % i for i in range(100)] + [None, "text", b""]
+    sealed = cryptoHandler.encrypt_column(column, provider.key_id, provider, None)
+    assert sealed[100] is None and provider.generated == 1
+    assert cryptoHandler.decrypt(sealed[7], provider, cache=None) == b"4111-0007"
+    assert cryptoHandler.decrypt(sealed[101], provider, cache=None) == b"text"
+    opened = cryptoHandler.decrypt_column(sealed, provider, cache=None, workers=3)
+    assert opened == column[:101] + [b"text", b""]
+    assert provider.decrypted == 3
+
+
+def test_column_with_mixed_envelopes_falls_back_to_per_row(provider):
+    sealed = cryptoHandler.encrypt_column([b"a", b"b"], provider.key_id, provider, None)
+    other = cryptoHandler.encrypt(b"c", provider.key_id, provider, None)
+    opened = cryptoHandler.decrypt_column(sealed + [other], provider, cache=None)
+    assert opened == [b"a", b"b", b"c"]
+    forged = bytearray(sealed[1])
+    forged[-1] ^= 1
+    with pytest.raises(DecryptionError, match="row 1"):
+        cryptoHandler.decrypt_column([sealed[0], bytes(forged)], provider, cache=None)
+
+
+def test_arrow_column_round_trip(provider):
+    pa = pytest.importorskip("pyarrow")
+    chunks = [["alice", None, "bob"], ["carol" * 100]]
+    sealed = cryptoHandler.encrypt_column(
+        pa.chunked_array(chunks), provider.key_id, provider, None
+    )
+    assert sealed.null_count == 1 and pa.types.is_binary(sealed.type)
+    opened = cryptoHandler.decrypt_column(sealed, provider, cache=None)
+    assert opened.to_pylist() == [b"alice", None, b"bob", b"carol" * 100]
+
+
+def test_token_column_matches_single_tokens(provider):
+    wrapped = cryptoHandler.DeterministicKey.generate(provider.key_id, provider)
+    key = cryptoHandler.DeterministicKey(provider.key_id, wrapped, provider, None)
+    column = ["a@example.com", None, b"b@example.com", ""]
+    tokens = key.token_column(column)
+    assert tokens == [key.token(column[0]), None, key.token(column[2]), key.token("")]
+
+
+def test_deterministic_key_is_derived_again_after_a_snapshot(provider):
+    wrapped = cryptoHandler.DeterministicKey.generate(provider.key_id, provider)
+    key = cryptoHandler.DeterministicKey(provider.key_id, wrapped, provider, None)
+    token, sealed = key.token("a@example.com"), key.encrypt("a@example.com")
+    cleanUp.before_snapshot()
+    assert key._cipher is None and key._token_key == bytes(len(key._token_key))
+    assert key.token("a@example.com") == token
+    assert key.decrypt(sealed) == b"a@example.com"
+    assert provider.decrypted == 2
+
+
+def test_batch_round_trip_reports_per_record(provider):
+    records = [b"record-%d" % i for i in range(50)] + ["not bytes"]
+    results = cryptoHandler.encrypt_batch(records, provider.key_id, provider, None)
+    assert [r.ok for r in results] == [True] * 50 + [False]
+    envelopes = [r.envelope for r in results[:50]]
+    nonces = {cryptoHandler.parse_envelope(e)["nonce"] for e in envelopes}
+    assert len(nonces) == 50 and provider.generated == 1
+    assert cryptoHandler.decrypt(envelopes[7], provider, cache=None) == b"record-7"
+    envelopes[3] = envelopes[3][:-1] + bytes([envelopes[3][-1] ^ 1])
+    opened = cryptoHandler.decrypt_batch(envelopes, provider, cache=None)
+    assert [r.plaintext for r in opened if r.ok] == records[:3] + records[4:50]
+    assert not opened[3].ok
+
+
+def test_keyring_rotation_rewraps_without_reencrypting():
+    masters = {name: os.urandom(32) for name in ("alias/app", "v1", "v2")}
+    inner = cryptoHandler.LocalKeyProvider(masters)
+    rewraps = []
+    rewrap_data_key = inner.rewrap_data_key
+
+    def counting_rewrap(*args):
+        rewraps.append(args)
+        return rewrap_data_key(*args)
+
+    inner.rewrap_data_key = counting_rewrap
+    legacy = cryptoHandler.encrypt(b"legacy", "alias/app", inner, cache=None)
+    keyring = cryptoHandler.Keyring("alias/app", {1: "v1"}, inner)
+    cache = DataKeyCache()
+    batch = cryptoHandler.encrypt_batch([b"a", b"b"], "alias/app", keyring, cache)
+    envelopes = [r.envelope for r in batch]
+    assert keyring.rotate("v2", cache) == 2
+    assert keyring.version(cryptoHandler.parse_envelope(envelopes[0])["key"]) == 1
+    assert cryptoHandler.decrypt(envelopes[0], keyring, cache) == b"a"
+
+    migrated = [keyring.rewrap(e, cache) for e in (*envelopes, legacy)]
+    assert len(rewraps) == 2
+    fields = [cryptoHandler.parse_envelope(e) for e in migrated]
+    assert [keyring.version(f["key"]) for f in fields] == [2, 2, 2]
+    assert fields[0]["ct"] == cryptoHandler.parse_envelope(envelopes[0])["ct"]
+    assert keyring.rewrap(migrated[0], cache) is migrated[0]
+    opened = cryptoHandler.decrypt_many(migrated, keyring, cache=None)
+    assert [r.plaintext for r in opened] == [b"a", b"b", b"legacy"]
+
+    written = []
+    keyring.rotate("v1", cache)
+    keyring.rewrap_later(migrated[2], written.append).result()
+    assert keyring.version(cryptoHandler.parse_envelope(written[0])["key"]) == 3
+    assert keyring.rewrap_later(written[0], written.append) is None
+
+
+def test_truncated_keyring_header_is_rejected():
+    inner = cryptoHandler.LocalKeyProvider({})
+    keyring = cryptoHandler.Keyring("alias/app", {1: "v1"}, inner)
+    assert keyring.version(b"wrapped") is None
+    for wrapped_key in (b"SDSK", memoryview(b"xSDSK")[1:]):
+        with pytest.raises(cryptoHandler.CryptoError, match="truncated keyring"):
+            keyring.version(wrapped_key)
+
+
+def test_compression_is_opt_in_and_skips_incompressible(provider):
+    compress = cryptoHandler.Compression("zlib", min_size=256)
+    line = b'{"level":"info","msg":"request %d served"}\n'
+    log = b"".join(line % i for i in range(200))
+    plain = cryptoHandler.encrypt(log, provider.key_id, provider, None)
+    kid = provider.key_id
+    packed = cryptoHandler.encrypt(log, kid, provider, None, compress=compress)
+    assert cryptoHandler.parse_envelope(plain)["codec"] is None
+    assert cryptoHandler.parse_envelope(packed)["codec"] == "zlib"
+    assert len(packed) * 5 < len(plain)
+    assert cryptoHandler.decrypt(packed, provider, cache=None) == log
+    for skipped in (os.urandom(4096), log[:100]):
+        envelope = cryptoHandler.encrypt(skipped, provider.key_id, provider, None)
+        assert cryptoHandler.parse_envelope(envelope)["codec"] is None
+
+    results = cryptoHandler.encrypt_batch(
+        [log, os.urandom(512)], provider.key_id, provider, None, compress=compress
+    )
+    envelopes = [result.envelope for result in results]
+    codecs = [cryptoHandler.parse_envelope(e)["codec"] for e in envelopes]
+    assert codecs == ["zlib", None]
+    opened = cryptoHandler.decrypt_batch(envelopes, provider, cache=None)
+    assert opened[0].plaintext == log
+
+    schema = cryptoHandler.FieldSchema(["body", "id"], compress={"body": compress})
+    document = {"body": log.decode(), "id": 7}
+    schema.encrypt(document, provider.key_id, provider, cache=None)
+    assert cryptoHandler.parse_envelope(document["body"])["codec"] == "zlib"
+    assert cryptoHandler.parse_envelope(document["id"])["codec"] is None
+    assert schema.decrypt(document, provider, None) == {"body": log.decode(), "id": 7}
+
+
+def test_compressed_stream_round_trip(provider):
+    payload = b"".join(b"line %d of a log file\n" % i for i in range(5000))
+    sealed = io.BytesIO()
+    cryptoHandler.encrypt_stream(
+        io.BytesIO(payload),
+        sealed,
+        provider.key_id,
+        provider,
+        None,
+        chunk_size=1024,
+        compress=cryptoHandler.Compression("zlib"),
+    )
+    assert len(sealed.getvalue()) * 5 < len(payload)
+    opened = io.BytesIO()
+    source = io.BytesIO(sealed.getvalue())
+    cryptoHandler.decrypt_stream(source, opened, provider, None, read_size=100)
+    assert opened.getvalue() == payload
+
+
+def test_compressed_stream_chunks_inflate_a_chunk_at_a_time(provider, monkeypatch):
+    codec = cryptoHandler._CODECS["zlib"]
+    pieces = []
+
+    class Recording:
+        def __init__(self, decompressor):
+            self._decompressor = decompressor
+
+        def decompress(self, data, max_length):
+            piece = self._decompressor.decompress(data, max_length)
+            pieces.append(len(piece))
+            return piece
+
+        def __getattr__(self, name):
+            return getattr(self._decompressor, name)
+
+    decompressobj = codec.decompressobj
+    monkeypatch.setattr(codec, "decompressobj", lambda: Recording(decompressobj()))
+    payload = bytes(256 * 1024)
+    sealed, opened = _stream_round_trip(provider, payload, 1024, compress="zlib")
+    assert opened == payload
+    assert len(sealed) < 2048 and max(pieces) == 1024
+
+
+def test_compressed_stream_must_end_its_frame(provider, monkeypatch):
+    compressobj = zlib.compressobj
+
+    class Unfinished:
+        def __init__(self, *args):
+            self._compressor = compressobj(*args)
+
+        def compress(self, data):
+            return self._compressor.compress(data)
+
+        def flush(self):
+            return self._compressor.flush(zlib.Z_SYNC_FLUSH)
+
+    monkeypatch.setattr(zlib, "compressobj", Unfinished)
+    with pytest.raises(DecryptionError, match="mid-frame"):
+        _stream_round_trip(provider, b"log line\n" * 500, 1024, compress="zlib")
@@ -0,0 +1,44 @@
+import subprocess
+import sys
+
+# Cumulative import time of the deepest SDS module, in milliseconds.  Loose
+# enough for a slow CI runner; what it catches is a heavy dependency coming
+# back onto the import path.
+IMPORT_BUDGET_MS = 250
+
+DEFERRED = (
+    "asyncio",
+    "boto3",
+    "concurrent.futures",
+    "cryptography",
+    "ctypes.util",
+    "ssl",
+    "tempfile",
+)
+
+
+def _import_times(statement):
+    result = subprocess.run(
+        [sys.executable, "-X", "importtime", "-c", statement],
+        capture_output=True,
+        text=True,
+        check=True,
+    )
+    times = {}
+    for line in result.stderr.splitlines():
+        if not line.startswith("import time:") or "self [us]" in line:
+            continue
+        _, cumulative, name = line[len("import time:") :].split("|")
+        times[name.strip()] = int(cumulative)
+    return times
+
+
+def test_package_import_loads_no_submodules():
+    times = _import_times("import SDS")
+    assert [name for name in times if name.startswith("SDS.")] == []
+
+
+def test_heavy_dependencies_are_deferred():
+    times = _import_times("import SDS.secureContext, SDS.lambdaExtension")
+    assert [name for name in DEFERRED if name in times] == []
+    assert times["SDS.secureContext"] / 1000 < IMPORT_BUDGET_MS
@@ -0,0 +1,88 @@
+import http.server
+import json
+import threading
+import time
+import types
+
+import pytest
+
+from SDS import cleanUp, lambdaExtension
+from SDS.secureContext import shielded
+
+
+class FakeRuntimeAPI(http.server.ThreadingHTTPServer):
+    """Extensions API stand-in that hands out one INVOKE event."""
+
+    def __init__(self):
+        super().__init__(("127.0.0.1", 0), FakeRuntimeHandler)
+        self.requests = []
+        self.done = threading.Event()
+
+
+class FakeRuntimeHandler(http.server.BaseHTTPRequestHandler):
+    def log_message(self, *args):
+        pass
+
+    def _reply(self, body, headers=()):
+        self.send_response(200)
+        for name, value in headers:
+            self.send_header(name, value)
+        self.send_header("Content-Length", str(len(body)))
+        self.end_headers()
+        self.wfile.write(body)
+
+    def do_POST(self):
+        self.rfile.read(int(self.headers["Content-Length"]))
+        self.server.requests.append("register")
+        self._reply(b"{}", [("Lambda-Extension-Identifier", "ext-1")])
+
+    def do_GET(self):
+        self.server.requests.append("next")
+        if len(self.server.requests) > 2:
+            self.server.done.set()
+            self._reply(json.dumps({"eventType": "SHUTDOWN"}).encode())
+            return
+        deadline = int((time.time() + 30) * 1000)
+        event = {"eventType": "INVOKE", "requestId": "req-ext", "deadlineMs": deadline}
+        self._reply(json.dumps(event).encode())
+
+
+@pytest.fixture
+def runtime_api(monkeypatch):
+    server = FakeRuntimeAPI()
+    threading.Thread(target=server.serve_forever, daemon=True).start()
+    monkeypatch.setenv("AWS_LAMBDA_RUNTIME_API", f"127.0.0.1:{server.server_port}")
+    monkeypatch.setattr(lambdaExtension, "_thread", None)
+    monkeypatch.setattr(cleanUp, "_invocation_hooks", [])
+    monkeypatch.setattr(cleanUp, "_defers", False)
+    yield server
+    server.shutdown()
+    server.server_close()
+
+
+def test_extension_waits_for_deferred_cleanup(runtime_api):
+    cleanUp.expect_deferred()
+    assert lambdaExtension.start()
+    time.sleep(0.1)
+    # INVOKE delivered; the extension holds off until req-ext is cleaned up.
+    assert runtime_api.requests == ["register", "next"]
+    cleanUp.clean_up(defer=True, request_id="req-ext")
+    assert runtime_api.done.wait(5)
+
+
+def test_extension_does_not_hold_non_deferred_invocations(runtime_api):
+    @shielded(prefetch=False)
+    def handler(event, context, secrets):
+        return event
+
+    context = types.SimpleNamespace(aws_request_id="req-ext")
+    assert lambdaExtension.start()
+    assert handler("ok", context) == "ok"
+    assert runtime_api.done.wait(5)
+    assert cleanUp.wait_for_cleanup("req-ext", 0)
+
+
+def test_start_is_a_no_op_outside_lambda(monkeypatch):
+    monkeypatch.delenv("AWS_LAMBDA_RUNTIME_API", raising=False)
+    monkeypatch.setattr(lambdaExtension, "_thread", None)
+    assert not lambdaExtension.start()
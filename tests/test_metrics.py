@@ -0,0 +1,58 @@
+import io
+import json
+
+import pytest
+
+from SDS import cryptoHandler, metrics
+from SDS.secureContext import SecureVar
+
+
+@pytest.fixture
+def emf():
+    metrics.enable("emf")
+    yield
+    metrics.disable()
+
+
+def test_phases_are_recorded(provider, emf):
+    var = SecureVar.seal(b"hunter2", provider.key_id, provider, cache=None)
+    var.reveal()
+    var.reveal()
+    values = metrics.snapshot()
+    assert values["key_fetch_count"] == 2
+    assert values["decrypt_count"] == 1
+    assert values["access_count"] == 2
+    assert values["key_fetches"] == 2
+
+
+def test_emit_writes_one_emf_line(provider, emf):
+    envelope = cryptoHandler.encrypt(b"x", provider.key_id, provider, cache=None)
+    cryptoHandler.decrypt(envelope, provider, cryptoHandler.DataKeyCache())
+    stream = io.StringIO()
+    metrics.emit(stream, dimensions={"FunctionName": "test"})
+    (line,) = stream.getvalue().splitlines()
+    document = json.loads(line)
+    (directive,) = document["_aws"]["CloudWatchMetrics"]
+    assert directive["Dimensions"] == [["FunctionName"]]
+    names = {metric["Name"] for metric in directive["Metrics"]}
+    assert {"key_fetch_ms", "decrypt_ms", "key_cache_misses"} <= names
+    assert document["key_cache_misses"] == 1
+    assert metrics.snapshot() == {}
+
+
+def test_byte_counters_are_emitted_in_bytes(provider, emf):
+    zlib = cryptoHandler.Compression("zlib")
+    cryptoHandler.encrypt(b"a" * 4096, provider.key_id, provider, None, compress=zlib)
+    stream = io.StringIO()
+    values = metrics.emit(stream, dimensions={})
+    assert values["compression_saved_bytes"] > 4000
+    (directive,) = json.loads(stream.getvalue())["_aws"]["CloudWatchMetrics"]
+    units = {metric["Name"]: metric["Unit"] for metric in directive["Metrics"]}
+    assert units["compression_saved_bytes"] == "Bytes"
+
+
+def test_disabled_records_nothing(provider):
+    assert not metrics.enabled
+    var = SecureVar.seal(b"hunter2", provider.key_id, provider, cache=None)
+    var.reveal()
+    assert metrics.snapshot() == {}
@@ -0,0 +1,120 @@
+import gc
+import mmap
+import os
+import weakref
+
+import pytest
+
+from SDS.secureBuffer import ArenaBuffer, SecretArena, SecureBuffer, SharedSegment
+
+
+def test_views_share_one_region():
+    buffer = SecureBuffer.from_bytes(b"hunter2")
+    view = buffer.view()
+    assert view.readonly
+    assert view[1:3].obj is view.obj
+    assert len(buffer) == 7
+
+
+def test_close_wipes_outstanding_views():
+    buffer = SecureBuffer.from_bytes(b"hunter2")
+    view = buffer.view()
+    buffer.close()
+    assert view == bytes(7)
+    with pytest.raises(ValueError):
+        buffer.view()
+
+
+def test_close_unmaps_when_no_views_remain():
+    buffer = SecureBuffer.from_bytes(b"hunter2")
+    buffer.close()
+    assert buffer._region.closed
+
+
+def test_arena_slots_are_size_classed_and_recycled():
+    arena = SecretArena(8192)
+    small = arena.allocate(20)
+    assert len(small) == 20 and arena.used == 32
+    small.close()
+    assert arena.allocate(30)._offset == small._offset
+    assert type(arena.allocate(5000)) is SecureBuffer
+
+
+def test_arena_reset_wipes_everything_in_one_pass():
+    arena = SecretArena(8192)
+    buffers = [arena.allocate(16) for _ in range(10)]
+    for buffer in buffers:
+        buffer.writable()[:] = b"s" * 16
+    views = [buffer.view() for buffer in buffers]
+    arena.reset()
+    assert all(view == bytes(16) for view in views)
+    assert all(buffer.closed for buffer in buffers)
+    assert arena.used == 0
+
+
+def test_full_arena_falls_back_to_standalone_buffers():
+    arena = SecretArena(mmap.PAGESIZE)
+    buffers = [arena.allocate(4096) for _ in range(2)]
+    assert type(buffers[0]) is ArenaBuffer
+    assert type(buffers[1]) is SecureBuffer
+
+
+def _sealed_segment(secret):
+    segment = SharedSegment(4096)
+    buffer = segment.allocate(len(secret))
+    buffer.writable()[:] = secret
+    return segment.seal(), buffer
+
+
+def _segment_bytes(inspect):
+    with mmap.mmap(inspect, 0, flags=mmap.MAP_SHARED) as raw:
+        return bytes(raw)
+
+
+def test_shared_segment_is_wiped_by_the_last_process():
+    segment, buffer = _sealed_segment(b"hunter2")
+    with pytest.raises(ValueError):
+        buffer.writable()
+    inspect = os.dup(segment._fd)
+    go, wait = os.pipe()
+    pid = os.fork()
+    if pid == 0:
+        # The master detaches first, before this worker has run any code.
+        os.read(go, 1)
+        ok = bytes(buffer.view()) == b"hunter2"
+        segment.detach()
+        os._exit(0 if ok else 1)
+    try:
+        segment.detach()
+        assert _segment_bytes(inspect).startswith(b"hunter2")
+    finally:
+        os.write(wait, b"x")
+    assert os.waitpid(pid, 0)[1] == 0
+    assert not any(_segment_bytes(inspect))
+    for fd in (inspect, go, wait):
+        os.close(fd)
+
+
+def test_workers_that_skip_shutdown_do_not_pin_the_segment():
+    segment, buffer = _sealed_segment(b"hunter2")
+    inspect = os.dup(segment._fd)
+    pid = os.fork()
+    if pid == 0:
+        os._exit(0 if bytes(buffer.view()) == b"hunter2" else 1)
+    assert os.waitpid(pid, 0)[1] == 0
+    segment.detach()
+    assert not any(_segment_bytes(inspect))
+    os.close(inspect)
+
+
+def test_dropped_shared_segments_are_released():
+    segments = [SharedSegment(4096) for _ in range(3)]
+    alive = [weakref.ref(segment) for segment in segments]
+    segments[1].allocate(7).writable()[:] = b"hunter2"
+    inspect = os.dup(segments[1]._fd)
+    segments[0].detach()
+    del segments
+    gc.collect()
+    assert [ref() for ref in alive] == [None, None, None]
+    assert not any(_segment_bytes(inspect))  # detached on collection
+    os.close(inspect)
@@ -1,3 +1,237 @@
-def test_example():
-    # your test code
-    assert True
+import asyncio
+import threading
+import time
+import types
+
+from SDS import cleanUp, cryptoHandler, metrics
+from SDS.secureContext import BoundPool, SecretManifest, SecureContext, shielded
+
+
+def _envelopes(provider, **secrets):
+    return {
+        name: cryptoHandler.encrypt(value, provider.key_id, provider, cache=None)
+        for name, value in secrets.items()
+    }
+
+
+def test_unread_secrets_are_never_decrypted(provider):
+    secrets = _envelopes(provider, db=b"db-pass", api=b"token", ssn=b"123")
+    with SecureContext(secrets, provider, cache=None) as ctx:
+        assert ctx.reveal("api") == b"token"
+        assert provider.decrypted == 1
+        assert not ctx["db"].decrypted
+
+
+def test_close_wipes_revealed_plaintext(provider):
+    ctx = SecureContext(_envelopes(provider, db=b"db-pass"), provider, cache=None)
+    view = ctx.reveal("db")
+    ctx.close()
+    assert view == bytes(7)
+    assert not ctx["db"].decrypted
+
+
+def test_mapping_protocol(provider):
+    ctx = SecureContext(_envelopes(provider, a=b"1", b=b"2"), provider, cache=None)
+    assert len(ctx) == 2
+    assert "a" in ctx
+    assert sorted(ctx) == ["a", "b"]
+
+
+def test_load_decrypts_in_one_batch(provider):
+    secrets = _envelopes(provider, a=b"1", b=b"2", c=b"3")
+    secrets["broken"] = "not an envelope"
+    ctx = SecureContext(secrets, provider, cache=None)
+    errors = ctx.load(["a", "b", "broken"])
+    assert list(errors) == ["broken"]
+    assert ctx["a"].decrypted and ctx["b"].decrypted and not ctx["c"].decrypted
+    assert ctx.reveal("b") == b"2"
+
+
+def test_async_context(provider):
+    secrets = _envelopes(provider, a=b"1", b=b"2", c=b"3")
+
+    async def handler():
+        async with SecureContext(secrets, provider, cache=None) as ctx:
+            assert await ctx.aload(["a", "b"]) == {}
+            assert await ctx.areveal("c") == b"3"
+            return [bytes(ctx.reveal(name)) for name in ctx]
+
+    assert asyncio.run(handler()) == [b"1", b"2", b"3"]
+    assert provider.decrypted == 3
+
+
+def test_prefetched_manifest_seeds_the_first_context(provider, monkeypatch):
+    envelopes = _envelopes(provider, db=b"db-pass", api=b"token")
+    monkeypatch.setenv("SDS_TEST_API", cryptoHandler.to_text(envelopes["api"]))
+    manifest = SecretManifest(
+        {"db": envelopes["db"]}, env={"api": "SDS_TEST_API"}, provider=provider
+    ).prefetch()
+    with manifest.context(timeout=10) as ctx:
+        assert ctx["db"].decrypted and ctx["api"].decrypted
+        assert provider.decrypted == 2
+        assert ctx.reveal("api") == b"token"
+    with manifest.context() as ctx:
+        assert not ctx["db"].decrypted
+
+
+def test_manifest_acontext(provider):
+    manifest = SecretManifest(_envelopes(provider, db=b"db-pass"), provider=provider)
+    manifest.prefetch()
+    ctx = asyncio.run(manifest.acontext())
+    assert ctx["db"].decrypted
+
+
+def test_shared_manifest_decrypts_once_for_every_context(provider):
+    secrets = _envelopes(provider, db=b"db-pass", api=b"token")
+    manifest = SecretManifest(secrets, provider=provider, cache=None).share()
+    try:
+        for _ in range(3):
+            with manifest.context() as ctx:
+                assert ctx.reveal("db") == b"db-pass"
+                assert ctx.reveal("api") == b"token"
+        assert provider.decrypted == 2
+    finally:
+        manifest.segment.detach()
+
+
+def test_shared_manifest_fits_compressed_secrets(provider):
+    payload = b"certificate-chain " * 4096
+    envelope = cryptoHandler.encrypt(
+        payload, provider.key_id, provider, None, compress=cryptoHandler.Compression()
+    )
+    assert len(envelope) < len(payload) // 10
+    manifest = SecretManifest({"chain": envelope}, provider=provider, cache=None)
+    try:
+        with manifest.share().context() as ctx:
+            assert ctx.reveal("chain") == payload
+    finally:
+        manifest.segment.detach()
+
+
+def test_tokenize_memoises_repeated_identifiers(provider):
+    wrapped = cryptoHandler.DeterministicKey.generate(provider.key_id, provider)
+    key = cryptoHandler.DeterministicKey(provider.key_id, wrapped, provider, None)
+    calls = []
+    token = key.token
+    key.token = lambda value: calls.append(value) or token(value)
+    with SecureContext(provider=provider, token_cache_size=2) as ctx:
+        tokens = [ctx.tokenize(key, v) for v in ["a", "b", "a", "a", "c", "b"]]
+    assert tokens[0] == tokens[2] == token("a") != tokens[1]
+    assert calls == ["a", "b", "c", "b"]
+
+
+class _Pool:
+    def __init__(self, password):
+        self.password = password
+        self.closed = False
+
+    def close(self):
+        self.closed = True
+
+
+def test_bound_pool_survives_invocations_until_the_secret_rotates(provider):
+    pool = BoundPool(lambda var: _Pool(var.text()))
+    first = SecureContext(_envelopes(provider, db=b"db-pass"), provider, cache=None)
+    warm = pool.get(first["db"])
+    cleanUp.clean_up()
+    again = SecureContext({"db": first["db"].envelope}, provider, cache=None)
+    assert pool.get(again["db"]) is warm and not warm.closed
+    assert provider.decrypted == 1
+
+    rotated = SecureContext(_envelopes(provider, db=b"new-pass"), provider, None)
+    fresh = pool.get(rotated["db"])
+    assert warm.closed and fresh.password == "new-pass"
+    assert cleanUp.invalidate(rotated["db"].version) == 1
+    rebuilt = pool.get(rotated["db"])
+    assert fresh.closed and rebuilt is not fresh
+    cleanUp.shutdown()
+    assert rebuilt.closed
+
+
+def test_memory_cap_evicts_cold_variables(provider):
+    secrets = _envelopes(provider, a=b"1" * 40, b=b"2" * 40, c=b"3" * 40)
+    ctx = SecureContext(secrets, provider, cache=None, memory_cap=128)
+    ctx.reveal("a")
+    ctx.reveal("b")
+    usage = ctx.memory()
+    assert usage["plaintext_bytes"] == 80 and usage["secret_bytes"] == 128
+    assert usage["locked_bytes"] in (0, 128)
+    ctx.reveal("a")
+    assert ctx.reveal("c") == b"3" * 40
+    assert ctx["a"].decrypted and not ctx["b"].decrypted
+    assert ctx.memory()["secret_bytes"] == 128
+    assert ctx.reveal("b") == b"2" * 40
+    assert not ctx["a"].decrypted
+
+
+def test_admission_keeps_running_totals(provider, monkeypatch):
+    secrets = _envelopes(provider, **{f"s{i}": b"x" * 40 for i in range(20)})
+    ctx = SecureContext(secrets, provider, cache=None)
+    monkeypatch.setattr(ctx, "memory", None)  # admission must not walk them all
+    ctx.load()
+    assert ctx._usage == [0, 0, 0]
+    monkeypatch.setattr(metrics, "enabled", True)
+    ctx.close()
+    ctx.load()
+    monkeypatch.undo()
+    metrics.reset()
+    assert ctx._usage == list(ctx.memory().values())
+    ctx["s3"].wipe()
+    assert ctx._usage == list(ctx.memory().values())
+    assert ctx._usage[0] == 19 * 40
+
+
+def test_shielded_handler_resolves_everything_at_decoration(provider, monkeypatch):
+    envelopes = _envelopes(provider, db=b"db-pass")
+    monkeypatch.setenv("SDS_TEST_DB", cryptoHandler.to_text(envelopes["db"]))
+    seen = []
+
+    @shielded(secrets=["SDS_TEST_DB"], provider=provider, cache=None)
+    def handler(event, context, secrets):
+        seen.append(secrets["SDS_TEST_DB"])
+        return bytes(secrets.reveal("SDS_TEST_DB")) + event
+
+    monkeypatch.delenv("SDS_TEST_DB")
+    assert handler(b"!", None) == b"db-pass!"
+    assert handler(b"?", None) == b"db-pass?"
+    assert handler.__name__ == "handler"
+    assert provider.decrypted == 2
+    assert not any(var.decrypted for var in seen)
+
+
+def test_snapshot_drops_prefetched_plaintext_and_cached_keys(provider):
+    cache = cryptoHandler.DataKeyCache()
+
+    @shielded(_envelopes(provider, db=b"db-pass"), provider=provider, cache=cache)
+    def handler(event, context, secrets):
+        return bytes(secrets.reveal("db"))
+
+    prefetched = handler.manifest._prefetched.result(timeout=10)
+    cleanUp.before_snapshot()
+    assert prefetched["db"].plaintext.closed and len(cache) == 0
+    cleanUp.after_restore()
+    assert handler(None, None) == b"db-pass"
+    assert provider.decrypted == 2
+
+
+def test_shielded_handler_waits_for_the_previous_deferred_cleanup(
+    provider, monkeypatch
+):
+    release, order = threading.Event(), []
+    monkeypatch.setattr(cleanUp, "_invocation_hooks", [])
+    cleanUp.register_invocation_hook(lambda: release.wait(5) and order.append("wiped"))
+    envelopes = _envelopes(provider, db=b"db-pass")
+
+    @shielded(envelopes, provider=provider, cache=None, prefetch=False, defer=True)
+    def handler(event, context, secrets):
+        order.append(event)
+
+    context = types.SimpleNamespace(aws_request_id="req-1")
+    handler("first", context)
+    second = threading.Thread(target=handler, args=("second", context))
+    second.start()
+    time.sleep(0.05)
+    release.set()
+    second.join(5)
+    cleanUp.begin_invocation(timeout=5)
+    assert order == ["first", "wiped", "second", "wiped"]
@@ -1,3 +1,73 @@
-def test_example():
-    # your test code
-    assert True
+import concurrent.futures
+import hashlib
+import mmap
+import threading
+
+from SDS import cleanUp
+from SDS.secureContext import SecureVar
+
+
+def test_not_decrypted_until_revealed(provider):
+    var = SecureVar.seal(b"hunter2", provider.key_id, provider, cache=None)
+    assert not var.decrypted
+    assert provider.decrypted == 0
+    assert var.reveal() == b"hunter2"
+    assert var.decrypted
+
+
+def test_plaintext_cached_after_first_access(provider):
+    var = SecureVar.seal(b"hunter2", provider.key_id, provider, cache=None)
+    var.reveal()
+    assert var.text() == "hunter2"
+    assert provider.decrypted == 1
+
+
+def test_reveal_is_read_only(provider):
+    var = SecureVar.seal(b"hunter2", provider.key_id, provider, cache=None)
+    assert var.reveal().readonly
+
+
+def test_wipe_returns_to_ciphertext_only(provider):
+    var = SecureVar.seal(b"hunter2", provider.key_id, provider, cache=None)
+    view = var.reveal()
+    var.wipe()
+    assert view == bytes(7)
+    assert not var.decrypted
+    assert var.reveal() == b"hunter2"
+
+
+def test_repr_does_not_leak(provider):
+    var = SecureVar.seal(b"hunter2", provider.key_id, provider, cache=None)
+    var.reveal()
+    assert "hunter2" not in repr(var)
+
+
+def test_plaintext_lives_in_a_secure_buffer(provider):
+    var = SecureVar.seal(b"hunter2", provider.key_id, provider, cache=None)
+    view = var.reveal()
+    assert isinstance(view.obj, mmap.mmap)
+    assert view[2:5] == b"nte"
+    assert var.digest() == hashlib.sha256(b"hunter2").digest()
+    assert var.equals(b"hunter2") and not var.equals(b"hunter3")
+
+
+def test_redecrypts_after_invocation_cleanup(provider):
+    var = SecureVar.seal(b"hunter2", provider.key_id, provider, cache=None)
+    view = var.reveal()
+    cleanUp.clean_up()
+    assert view == bytes(7)
+    assert not var.decrypted
+    assert var.reveal() == b"hunter2"
+
+
+def test_concurrent_readers_decrypt_once(provider):
+    var = SecureVar.seal(b"hunter2", provider.key_id, provider, cache=None)
+    barrier = threading.Barrier(8)
+
+    def read(_):
+        barrier.wait()
+        return bytes(var.reveal())
+
+    with concurrent.futures.ThreadPoolExecutor(8) as pool:
+        assert list(pool.map(read, range(8))) == [b"hunter2"] * 8
+    assert provider.decrypted == 1